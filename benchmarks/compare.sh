@@ -0,0 +1,57 @@
+#!/usr/bin/env bash
+#
+# Compares the switch and computed-goto dispatch loops of clox on every
+# script in this directory. A separate build with -DCOUNT_INSTRUCTIONS
+# counts the bytecode instructions each script executes; the two timed
+# builds then report that count divided by their wall-clock time. The
+# computed-goto build is timed again with its JIT enabled.
+#
+# Usage: benchmarks/compare.sh [script.lox ...]
+
+set -euo pipefail
+
+BENCHDIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+CLOXDIR="$BENCHDIR/../clox"
+WORKDIR="$(mktemp -d)"
+trap 'rm -rf "$WORKDIR"' EXIT
+
+build() {
+    local name="$1"; shift
+    make -s -C "$CLOXDIR" "$WORKDIR/$name/bin/rel/clox" \
+        OBJDIR="$WORKDIR/$name/obj" BINDIR="$WORKDIR/$name/bin" "$@" >/dev/null
+    echo "$WORKDIR/$name/bin/rel/clox"
+}
+
+seconds() {
+    local start end
+    start=$(date +%s.%N)
+    "$@" >/dev/null
+    end=$(date +%s.%N)
+    awk -v s="$start" -v e="$end" 'BEGIN { printf "%.6f", e - s }'
+}
+
+COUNTER=$(build count EXTRA=-DCOUNT_INSTRUCTIONS)
+SWITCH=$(build switch DISPATCH=switch)
+GOTO=$(build goto DISPATCH=goto)
+
+if [ $# -eq 0 ]; then
+    set -- "$BENCHDIR"/*.lox
+fi
+
+printf "%-12s %14s %10s %14s %10s %14s %8s %10s %8s\n" \
+    "script" "instructions" "switch(s)" "switch(ips)" "goto(s)" "goto(ips)" \
+    "speedup" "jit(s)" "jit"
+
+for script in "$@"; do
+    count=$("$COUNTER" --no-jit "$script" 2>&1 >/dev/null |
+            sed -n 's/^Instructions: //p')
+    tswitch=$(seconds "$SWITCH" --no-jit "$script")
+    tgoto=$(seconds "$GOTO" --no-jit "$script")
+    tjit=$(seconds "$GOTO" --jit "$script")
+
+    awk -v name="$(basename "$script" .lox)" -v n="$count" \
+        -v ts="$tswitch" -v tg="$tgoto" -v tj="$tjit" 'BEGIN {
+        printf "%-12s %14d %10.3f %14.0f %10.3f %14.0f %7.2fx %10.3f %7.2fx\n",
+               name, n, ts, n / ts, tg, n / tg, ts / tg, tj, tg / tj
+    }'
+done
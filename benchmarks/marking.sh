@@ -0,0 +1,44 @@
+#!/usr/bin/env bash
+#
+# Measures how long the collector spends marking the old generation of
+# mark.lox with each number of marking threads, as --stats reports it.
+# Every cycle marks in one go, so the times compare the whole mark phase
+# rather than slices of it. Thread counts past the cores of the machine
+# only show the cost of sharing the work.
+#
+# Usage: benchmarks/marking.sh [threads ...]
+#        (defaults to 1, 2, 4, ... up to the number of cores)
+
+set -euo pipefail
+
+BENCHDIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+CLOXDIR="$BENCHDIR/../clox"
+
+make -s -C "$CLOXDIR" release >/dev/null
+CLOX="$CLOXDIR/clox"
+
+if [ $# -eq 0 ]; then
+    cores=$(nproc)
+    threads=1
+    while [ "$threads" -lt "$cores" ]; do
+        set -- "$@" "$threads"
+        threads=$((threads * 2))
+    done
+    set -- "$@" "$cores"
+fi
+
+printf "%-8s %8s %12s %12s %10s\n" "threads" "cycles" "marking(ms)" "per cycle" "speedup"
+
+base=""
+for threads in "$@"; do
+    stats=$("$CLOX" --no-jit --no-cache --stats --gc-pause=0 \
+            --gc-threads="$threads" "$BENCHDIR/mark.lox" 2>&1 >/dev/null)
+    cycles=$(sed -n 's/^Collections *: \([0-9]*\).*/\1/p' <<< "$stats")
+    marking=$(sed -n 's/^Marking *: \([0-9.]*\) ms/\1/p' <<< "$stats")
+    [ -z "$base" ] && base="$marking"
+
+    awk -v t="$threads" -v c="$cycles" -v m="$marking" -v b="$base" 'BEGIN {
+        printf "%-8d %8d %12.3f %12.3f %9.2fx\n",
+               t, c, m, (c > 0 ? m / c : 0), (m > 0 ? b / m : 0)
+    }'
+done
@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "serialize.h"
+#include "vm.h"
+
+// A cache file holds, after the header serialize.h describes :
+//
+//   source hash, source length
+//   global count, then the name of each global slot
+//   the script's function
+//
+// A function is its arity, upvalue count, stack slots and name, then its
+// code, line table, inline cache count and constants. Nested functions are
+// written in place of the constants that hold them. Bump BYTECODE_VERSION
+// whenever this layout changes.
+#define BYTECODE_MAGIC      "LOXC"
+#define BYTECODE_VERSION    3
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+} ConstantTag;
+
+// The compiler only makes numbers, strings and functions into constants
+static bool
+writeFunction(Buffer *buffer, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+
+    writeInt(buffer, function->arity);
+    writeInt(buffer, function->upvalueCount);
+    writeInt(buffer, function->maxSlots);
+    writeInt(buffer, function->name != NULL);
+    if (function->name != NULL) writeString(buffer, function->name);
+
+    writeCode(buffer, chunk);
+
+    writeInt(buffer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+
+        if (IS_NUMBER(constant)) {
+            double number = AS_NUMBER(constant);
+            writeInt(buffer, CONSTANT_NUMBER);
+            writeBytes(buffer, &number, sizeof(number));
+        } else if (IS_STRING(constant)) {
+            writeInt(buffer, CONSTANT_STRING);
+            writeString(buffer, AS_STRING(constant));
+        } else if (IS_FUNCTION(constant)) {
+            writeInt(buffer, CONSTANT_FUNCTION);
+            if (!writeFunction(buffer, AS_FUNCTION(constant))) return false;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+saveBytecode(const char *path, const char *source, ObjFunction *function)
+{
+    size_t length = strlen(source);
+    Buffer buffer;
+
+    beginFile(&buffer, BYTECODE_MAGIC, BYTECODE_VERSION);
+    writeLong(&buffer, hashBytes(source, length));
+    writeLong(&buffer, length);
+
+    writeInt(&buffer, vm.globalNames.count);
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        writeString(&buffer, AS_STRING(vm.globalNames.values[i]));
+    }
+
+    if (!writeFunction(&buffer, function)) {
+        free(buffer.data);
+        return;
+    }
+
+    writeFile(&buffer, path);
+}
+
+// The function stays on the VM stack while it is filled in, which keeps it
+// and the constants it has so far alive through any collection.
+static ObjFunction *
+readFunction(Reader *reader)
+{
+    ObjFunction *function = newFunction();
+    push(OBJ_VAL(function));
+    Chunk *chunk = &function->chunk;
+
+    function->arity = readInt(reader);
+    function->upvalueCount = readInt(reader);
+    function->maxSlots = readInt(reader);
+    if (readInt(reader)) {
+        function->name = readString(reader);
+        if (function->name != NULL) {
+            objectBarrier((Obj *)function, (Obj *)function->name);
+        }
+    }
+
+    if (!readCode(reader, chunk)) {
+        pop();
+        return NULL;
+    }
+
+    int32_t constantCount = readCount(reader, sizeof(int32_t));
+    for (int i = 0; i < constantCount && !reader->failed; i++) {
+        Value constant = NIL_VAL;
+
+        switch ((ConstantTag)readInt(reader)) {
+            case CONSTANT_NUMBER: {
+                double number = 0;
+                const uint8_t *bytes = readBytes(reader, sizeof(number));
+                if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+                constant = NUMBER_VAL(number);
+                break;
+            }
+            case CONSTANT_STRING: {
+                ObjString *string = readString(reader);
+                if (string != NULL) constant = OBJ_VAL(string);
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction *nested = readFunction(reader);
+                if (nested != NULL) constant = OBJ_VAL(nested);
+                break;
+            }
+            default:
+                reader->failed = true;
+                break;
+        }
+
+        push(constant);
+        writeValueArray(&chunk->constants, constant);
+        writeBarrier((Obj *)function, constant);
+        pop();
+    }
+
+    pop();
+    return reader->failed ? NULL : function;
+}
+
+// The slots the bytecode refers to must be the slots its globals get in
+// this VM. Resolving them in the same order gives the same slots as long
+// as the VM defines the same globals before running the script.
+static bool
+readGlobals(Reader *reader)
+{
+    int32_t count = readCount(reader, sizeof(int32_t));
+    for (int i = 0; i < count && !reader->failed; i++) {
+        ObjString *name = readString(reader);
+        if (name == NULL || resolveGlobal(name) != i) return false;
+    }
+
+    return !reader->failed;
+}
+
+ObjFunction *
+loadBytecode(const char *path, const char *source)
+{
+    Reader reader;
+    if (!mapFile(&reader, path, BYTECODE_MAGIC, BYTECODE_VERSION)) {
+        return NULL;
+    }
+
+    size_t length = strlen(source);
+    ObjFunction *function = NULL;
+
+    if (readLong(&reader) == hashBytes(source, length) &&
+        readLong(&reader) == length &&
+        readGlobals(&reader)) {
+        function = readFunction(&reader);
+        if (reader.current != reader.end) function = NULL;
+    }
+
+    unmapFile(&reader);
+    return function;
+}
@@ -0,0 +1,18 @@
+#ifndef CLOX_BYTECODE_H
+#define CLOX_BYTECODE_H
+
+#include "object.h"
+
+// A compiled script can be saved to a cache file and loaded back by later
+// runs instead of compiling it again. The file records a hash of the source
+// and the global slots its bytecode refers to, and is only loaded while
+// both still match : loadBytecode() returns NULL otherwise, or when there
+// is no usable file at all.
+ObjFunction *
+loadBytecode(const char *path, const char *source);
+
+// Fails quietly, as a missing cache only costs the next run a compile
+void
+saveBytecode(const char *path, const char *source, ObjFunction *function);
+
+#endif // CLOX_BYTECODE_H
@@ -1,9 +1,12 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
 #include "vm.h"
 
+#define INDEX_MAX_LOAD 0.75
+
 void
 initChunk(Chunk *chunk)
 {
@@ -12,6 +15,10 @@ initChunk(Chunk *chunk)
     chunk->lines = NULL;
     chunk->count = 0;
     chunk->capacity = 0;
+
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
 }
 
 void
@@ -19,6 +26,7 @@ freeChunk(Chunk *chunk)
 {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -38,11 +46,240 @@ writeChunk(Chunk *chunk, uint8_t byte, int line)
     chunk->count++;
 }
 
+// Constants are only shared when they are the very same value. 0 and -0
+// are equal but print differently, so numbers compare by their bits.
+static bool
+sameConstant(Value a, Value b)
+{
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+
+    return valuesEqual(a, b);
+#endif // NAN_BOXING
+}
+
+void
+initConstantIndex(ConstantIndex *index)
+{
+    index->slots = NULL;
+    index->count = 0;
+    index->capacity = 0;
+}
+
+void
+freeConstantIndex(ConstantIndex *index)
+{
+    FREE_ARRAY(int, index->slots, index->capacity);
+    initConstantIndex(index);
+}
+
+// Strings are interned and keep their hash when the collector moves them,
+// so both kinds of key hash the same for as long as the chunk compiles
+static uint32_t
+hashConstant(Value value)
+{
+    if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    bits *= 0x9e3779b97f4a7c15u;
+    return (uint32_t)(bits >> 32);
+}
+
+// Returns the slot holding the value, or the empty slot it would go in.
+// Code thrown away along with its constants leaves indexes behind that
+// are past the end or name another constant, and those never match.
+static int *
+findConstant(ConstantIndex *index, ValueArray *constants, Value value)
+{
+    uint32_t slot = hashConstant(value) & (index->capacity - 1);
+
+    for (;;) {
+        int *entry = &index->slots[slot];
+        if (*entry == 0) return entry;
+
+        int constant = *entry - 1;
+        if (constant < constants->count &&
+            sameConstant(constants->values[constant], value)) {
+            return entry;
+        }
+
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+}
+
+static void
+growConstantIndex(ConstantIndex *index, ValueArray *constants)
+{
+    int *oldSlots = index->slots;
+    int oldCap = index->capacity;
+
+    index->capacity = GROW_CAPACITY(oldCap);
+    index->slots = ALLOCATE(int, index->capacity);
+    memset(index->slots, 0, sizeof(int) * index->capacity);
+    index->count = 0;
+
+    // Only the indexes that still name a constant move over
+    for (int i = 0; i < oldCap; i++) {
+        int constant = oldSlots[i] - 1;
+        if (constant < 0 || constant >= constants->count) continue;
+
+        Value value = constants->values[constant];
+        int *entry = findConstant(index, constants, value);
+        if (*entry != 0) continue;
+        *entry = oldSlots[i];
+        index->count++;
+    }
+
+    FREE_ARRAY(int, oldSlots, oldCap);
+}
+
 int
-addConstant(Chunk *chunk, Value value)
+addConstant(Chunk *chunk, ConstantIndex *index, Value value)
 {
+    ValueArray *constants = &chunk->constants;
+    int *entry = NULL;
     push(value);
-    writeValueArray(&chunk->constants, value);
+
+    // Functions are new objects each time, so only strings and numbers
+    // can ever repeat
+    if (IS_STRING(value) || IS_NUMBER(value)) {
+        if (index->count + 1 > index->capacity * INDEX_MAX_LOAD) {
+            growConstantIndex(index, constants);
+        }
+
+        entry = findConstant(index, constants, value);
+        if (*entry != 0) {
+            pop();
+            return *entry - 1;
+        }
+    }
+
+    writeValueArray(constants, value);
     pop();
-    return chunk->constants.count - 1;
+
+    if (entry != NULL) {
+        *entry = constants->count;
+        index->count++;
+    }
+
+    return constants->count - 1;
+}
+
+int
+addInlineCache(Chunk *chunk)
+{
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCap = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCap);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches,
+                                   oldCap, chunk->cacheCapacity);
+    }
+
+    InlineCache *cache = &chunk->caches[chunk->cacheCount];
+    cache->count = 0;
+    cache->megamorphic = false;
+    return chunk->cacheCount++;
+}
+
+int
+instructionLength(Chunk *chunk, int offset)
+{
+    switch ((OpCode)chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_EQUAL_NUM_NUM:
+        case OP_GREATER_NUM_NUM:
+        case OP_LESS_NUM_NUM:
+        case OP_ADD_NUM_NUM:
+        case OP_ADD_STR_STR:
+        case OP_SUBTRACT_NUM_NUM:
+        case OP_MULTIPLY_NUM_NUM:
+        case OP_DIVIDE_NUM_NUM:
+        case OP_NOT_EQUAL:
+        case OP_NOT_GREATER:
+        case OP_NOT_LESS:
+            return 1;
+
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_SET_LOCAL_POP:
+            return 2;
+
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONST:
+        case OP_SUBTRACT_LOCAL_CONST:
+            return 3;
+
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+
+        case OP_INVOKE:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_LESS_LOCAL_CONST_JUMP:
+            return 5;
+
+        case OP_CLOSURE: {
+            uint8_t constant = chunk->code[offset + 1];
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+            return 2 + function->upvalueCount * 2;
+        }
+
+        case OP_WIDE: {
+            uint8_t *code = &chunk->code[offset];
+
+            if (code[1] == OP_JUMP || code[1] == OP_JUMP_IF_FALSE ||
+                code[1] == OP_LOOP) {
+                return 6;
+            }
+
+            if (code[1] == OP_CLOSURE) {
+                uint16_t constant = (uint16_t)(code[2] << 8 | code[3]);
+                ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+                return 4 + function->upvalueCount * 3;
+            }
+
+            return 2 + instructionLength(chunk, offset + 1);
+        }
+    }
+
+    return 1; // Unreachable
 }
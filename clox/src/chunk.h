@@ -34,6 +34,7 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_INVOKE,
     OP_SUPER_INVOKE,
     OP_CLOSURE,
@@ -41,17 +42,85 @@ typedef enum {
     OP_RETURN,
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+
+    // Prefix for the long form of the next instruction : its first operand
+    // takes two bytes instead of one, or four instead of two for a jump.
+    // The upvalue indexes of a wide OP_CLOSURE take two bytes as well.
+    OP_WIDE,
+
+    // Quickened forms : the interpreter rewrites a generic instruction into
+    // one of these once it has seen the operand types, and back again when
+    // the types stop matching.
+    OP_EQUAL_NUM_NUM,
+    OP_GREATER_NUM_NUM,
+    OP_LESS_NUM_NUM,
+    OP_ADD_NUM_NUM,
+    OP_ADD_STR_STR,
+    OP_SUBTRACT_NUM_NUM,
+    OP_MULTIPLY_NUM_NUM,
+    OP_DIVIDE_NUM_NUM,
+
+    // Superinstructions : common sequences fused by optimizeChunk()
+    OP_NOT_EQUAL,               // OP_EQUAL, OP_NOT
+    OP_NOT_GREATER,             // OP_GREATER, OP_NOT
+    OP_NOT_LESS,                // OP_LESS, OP_NOT
+    OP_SET_LOCAL_POP,           // OP_SET_LOCAL, OP_POP
+    OP_ADD_LOCAL_LOCAL,         // OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD
+    OP_ADD_LOCAL_CONST,         // OP_GET_LOCAL, OP_CONSTANT, OP_ADD
+    OP_SUBTRACT_LOCAL_CONST,    // OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT
+    OP_GET_LOCAL_PROPERTY,      // OP_GET_LOCAL, OP_GET_PROPERTY
+    OP_LESS_LOCAL_CONST_JUMP    // OP_GET_LOCAL, OP_CONSTANT, OP_LESS,
+                                // OP_JUMP_IF_FALSE, OP_POP
 } OpCode;
 
+// Number of receiver shapes a property access site remembers before it
+// gives up and goes megamorphic.
+#define CACHE_WAYS 4
+
+typedef enum {
+    CACHE_FIELD,
+    CACHE_METHOD,
+    CACHE_TRANSITION
+} CacheKind;
+
+typedef struct {
+    ObjShape *shape;
+    CacheKind kind;
+    int slot;                   // Field slot for CACHE_FIELD and CACHE_TRANSITION
+    union {
+        ObjClosure *method;     // Method of the shape's class
+        ObjShape *transition;   // Shape after adding the field
+    } as;
+} CacheEntry;
+
+typedef struct {
+    CacheEntry entries[CACHE_WAYS];
+    int count;
+    bool megamorphic;
+} InlineCache;
+
 typedef struct {
     ValueArray constants;
     uint8_t *code;
     int *lines;
     int count;
     int capacity;
+
+    InlineCache *caches;
+    int cacheCount;
+    int cacheCapacity;
 } Chunk;
 
+// Maps the strings and numbers among a chunk's constants to their indexes
+// while it is compiled, so that addConstant() finds a duplicate without a
+// scan. Slots hold an index + 1, or 0 when empty.
+typedef struct {
+    int *slots;
+    int count;
+    int capacity;
+} ConstantIndex;
+
 void
 initChunk(Chunk *chunk);
 
@@ -61,7 +130,19 @@ freeChunk(Chunk *chunk);
 void
 writeChunk(Chunk *chunk, uint8_t byte, int line);
 
+void
+initConstantIndex(ConstantIndex *index);
+
+void
+freeConstantIndex(ConstantIndex *index);
+
+int
+addConstant(Chunk *chunk, ConstantIndex *index, Value value);
+
+int
+addInlineCache(Chunk *chunk);
+
 int
-addConstant(Chunk *chunk, Value value);
+instructionLength(Chunk *chunk, int offset);
 
 #endif // CLOX_CHUNK_H
@@ -7,6 +7,22 @@
 
 #define NAN_BOXING
 
+// Threaded dispatch through a table of label addresses in run(). Needs the
+// GNU "labels as values" extension; build with -DNO_COMPUTED_GOTO to force
+// the portable switch loop instead.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif // __GNUC__ && !NO_COMPUTED_GOTO
+
+// Baseline compiler from bytecode to x86-64 machine code for hot functions.
+// It relies on the NaN-boxed value layout; build with -DNO_JIT to leave it
+// out.
+#if defined(__x86_64__) && defined(NAN_BOXING) && !defined(NO_JIT)
+#define JIT
+#endif // __x86_64__ && NAN_BOXING && !NO_JIT
+
+// #define COUNT_INSTRUCTIONS
+
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 
@@ -14,5 +30,6 @@
 // #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif // CLOX_COMMON_H
@@ -5,15 +5,22 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif // DEBUG_PRINT_CODE
 
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *currentClass = NULL;
+// Each thread compiles on its own
+_Thread_local Parser parser;
+_Thread_local Compiler *current = NULL;
+_Thread_local ClassCompiler *currentClass = NULL;
+
+// Where the left operand of the infix expression being parsed starts, in
+// the code and in the constant table
+static _Thread_local int operandStart;
+static _Thread_local int operandConstants;
 
 static Chunk *
 currentChunk()
@@ -105,24 +112,52 @@ emitBytes(uint8_t byte1, uint8_t byte2)
 }
 
 static void
-emitLoop(int loopStart)
+emitShort(int value)
 {
-    emitByte(OP_LOOP);
+    emitBytes((value >> 8) & 0xff, value & 0xff);
+}
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+static void
+emitLong(int value)
+{
+    emitShort((value >> 16) & 0xffff);
+    emitShort(value & 0xffff);
+}
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+// Emits an instruction whose first operand is a byte, in its OP_WIDE form
+// when the operand does not fit.
+static void
+emitOperand(uint8_t instruction, int operand)
+{
+    if (operand > UINT8_MAX) {
+        emitBytes(OP_WIDE, instruction);
+        emitShort(operand);
+    } else {
+        emitBytes(instruction, (uint8_t)operand);
+    }
+}
+
+static void
+emitLoop(int loopStart)
+{
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX) {
+        emitByte(OP_LOOP);
+        emitShort(offset);
+    } else {
+        emitBytes(OP_WIDE, OP_LOOP);
+        emitLong(offset + 3);
+    }
 }
 
+// Forward jumps start out wide since their length is not known yet. The
+// optimizer narrows every one that turns out to fit in 16 bits.
 static int
 emitJump(uint8_t instruction)
 {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitBytes(OP_WIDE, instruction);
+    emitLong(-1);
+    return currentChunk()->count - 4;
 }
 
 static void
@@ -137,36 +172,65 @@ emitReturn()
     emitByte(OP_RETURN);
 }
 
-static uint8_t
+static int
 makeConstant(Value value)
 {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    int constant = addConstant(currentChunk(), &current->constants, value);
+    writeBarrier((Obj *)current->function, value);
+    if (constant > UINT16_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
 static void
 emitConstant(Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitOperand(OP_CONSTANT, makeConstant(value));
+}
+
+static void
+emitCache()
+{
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+
+    emitShort(cache);
 }
 
 static void
 patchJump(int offset)
 {
-    // -2 to adjust the bytecode for the jump offset
-    int jump = currentChunk()->count - offset - 2;
+    // -4 to adjust the bytecode for the jump offset
+    int jump = currentChunk()->count - offset - 4;
+
+    uint8_t *code = &currentChunk()->code[offset];
+    code[0] = (jump >> 24) & 0xff;
+    code[1] = (jump >> 16) & 0xff;
+    code[2] = (jump >> 8) & 0xff;
+    code[3] = jump & 0xff;
+}
+
+static Local *
+newLocal(Compiler *compiler)
+{
+    if (compiler->localCapacity < compiler->localCount + 1) {
+        int oldCapacity = compiler->localCapacity;
+        compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->locals = GROW_ARRAY(Local, compiler->locals, oldCapacity,
+                                      compiler->localCapacity);
+    }
 
-    if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+    Local *local = &compiler->locals[compiler->localCount++];
+    if (compiler->localCount > compiler->function->maxSlots) {
+        compiler->function->maxSlots = compiler->localCount;
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    return local;
 }
 
 static void
@@ -175,17 +239,25 @@ initCompiler(Compiler *compiler, FunctionType type)
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
     compiler->scopeDepth = 0;
+    initConstantIndex(&compiler->constants);
+    compiler->lastCall = -1;
     compiler->function = newFunction();
     current = compiler;
 
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start,
                                              parser.previous.length);
+        objectBarrier((Obj *)current->function,
+                      (Obj *)current->function->name);
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = newLocal(current);
     local->depth = 0;
     local->isCaptured = false;
 
@@ -204,6 +276,14 @@ endCompiler()
     emitReturn();
     ObjFunction *function = current->function;
 
+    if (!parser.hadError) {
+        optimizeChunk(currentChunk());
+
+        // Locals alone leave out the temporaries, argument lists included
+        int depth = maxStackDepth(currentChunk(), function->arity + 1);
+        if (depth > function->maxSlots) function->maxSlots = depth;
+    }
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), function->name != NULL ?
@@ -215,6 +295,14 @@ endCompiler()
     return function;
 }
 
+static void
+freeCompiler(Compiler *compiler)
+{
+    FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+    FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+    freeConstantIndex(&compiler->constants);
+}
+
 static void
 beginScope()
 {
@@ -243,9 +331,12 @@ endScope()
 static void
 parsePrecedence(Precedence precedence);
 
-static uint8_t
+static int
 identifierConstant(Token *name);
 
+static int
+identifierGlobal(Token *name);
+
 static int
 resolveUpvalue(Compiler *compiler, Token *name);
 
@@ -282,14 +373,124 @@ and_(bool canAssign)
     patchJump(endJump);
 }
 
+// Pushes a literal value, preferring the one-byte opcodes
+static void
+emitLiteral(Value value)
+{
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+}
+
+// Throws away the code emitted since start along with the constants added
+// since then, which only that code can use.
+static void
+discardCode(int start, int constants)
+{
+    currentChunk()->count = start;
+    currentChunk()->constants.count = constants;
+}
+
+// Reads the value of an operand spanning the code from start to end when
+// it is a single literal instruction.
+static bool
+constantOperand(int start, int end, Value *value)
+{
+    Chunk *chunk = currentChunk();
+    uint8_t *code = &chunk->code[start];
+
+    if (end - start == 2 && code[0] == OP_CONSTANT) {
+        *value = chunk->constants.values[code[1]];
+        return true;
+    }
+
+    if (end - start == 4 && code[0] == OP_WIDE && code[1] == OP_CONSTANT) {
+        *value = chunk->constants.values[code[2] << 8 | code[3]];
+        return true;
+    }
+
+    if (end - start != 1) return false;
+
+    switch (code[0]) {
+        case OP_NIL:        *value = NIL_VAL;           return true;
+        case OP_TRUE:       *value = BOOL_VAL(true);    return true;
+        case OP_FALSE:      *value = BOOL_VAL(false);   return true;
+        default:            return false;
+    }
+}
+
+static ObjString *
+concatenateConstants(ObjString *a, ObjString *b)
+{
+    ObjString *result = newString(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+
+    return internString(result);
+}
+
+// Computes a binary operator on two literals the way the VM would. Returns
+// false when the operation is a runtime error, which is left for the VM to
+// report.
+static bool
+foldBinary(TokenType opType, Value a, Value b, Value *result)
+{
+    switch (opType) {
+        case BANGEQ_TK:     *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+        case EQEQ_TK:       *result = BOOL_VAL(valuesEqual(a, b));  return true;
+        default:            break;
+    }
+
+    if (opType == PLUS_TK && IS_STRING(a) && IS_STRING(b)) {
+        *result = OBJ_VAL(concatenateConstants(AS_STRING(a), AS_STRING(b)));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch (opType) {
+        case GT_TK:         *result = BOOL_VAL(x > y);      break;
+        case GTEQ_TK:       *result = BOOL_VAL(!(x < y));   break;
+        case LT_TK:         *result = BOOL_VAL(x < y);      break;
+        case LTEQ_TK:       *result = BOOL_VAL(!(x > y));   break;
+        case MINUS_TK:      *result = NUMBER_VAL(x - y);    break;
+        case PLUS_TK:       *result = NUMBER_VAL(x + y);    break;
+        case SLASH_TK:      *result = NUMBER_VAL(x / y);    break;
+        case STAR_TK:       *result = NUMBER_VAL(x * y);    break;
+        default:            return false; // Unreachable
+    }
+
+    return true;
+}
+
 static void
 binary(bool canAssign)
 {
     TokenType opType = parser.previous.type;
+    int leftStart = operandStart;
+    int leftConstants = operandConstants;
+    int rightStart = currentChunk()->count;
 
     ParseRule *rule = getRule(opType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    // Both operands literals : replace them with the result
+    Value a, b, result;
+    if (constantOperand(leftStart, rightStart, &a) &&
+        constantOperand(rightStart, currentChunk()->count, &b) &&
+        foldBinary(opType, a, b, &result)) {
+        discardCode(leftStart, leftConstants);
+        emitLiteral(result);
+        return;
+    }
+
     switch (opType) {
         case BANGEQ_TK:     emitBytes(OP_EQUAL, OP_NOT);    break;
         case EQEQ_TK:       emitByte(OP_EQUAL);             break;
@@ -309,6 +510,7 @@ static void
 call(bool canAssign)
 {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -316,17 +518,20 @@ static void
 dot(bool canAssign)
 {
     consume(IDENTIFIER_TK, "Expected property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if (canAssign && match(EQ_TK)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitOperand(OP_SET_PROPERTY, name);
+        emitCache();
     } else if (match(LPAREN_TK)) {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        emitOperand(OP_INVOKE, name);
         emitByte(argCount);
+        emitCache();
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitOperand(OP_GET_PROPERTY, name);
+        emitCache();
     }
 }
 
@@ -352,9 +557,27 @@ static void
 unary(bool canAssign)
 {
     TokenType opType = parser.previous.type;
+    int start = currentChunk()->count;
+    int constants = currentChunk()->constants.count;
 
     parsePrecedence(PREC_UNARY);
 
+    Value value;
+    if (constantOperand(start, currentChunk()->count, &value)) {
+        if (opType == BANG_TK) {
+            discardCode(start, constants);
+            emitLiteral(BOOL_VAL(IS_NIL(value) ||
+                                 (IS_BOOL(value) && !AS_BOOL(value))));
+            return;
+        }
+
+        if (opType == MINUS_TK && IS_NUMBER(value)) {
+            discardCode(start, constants);
+            emitLiteral(NUMBER_VAL(-AS_NUMBER(value)));
+            return;
+        }
+    }
+
     switch (opType) {
         case BANG_TK:   emitByte(OP_NOT);       break;
         case MINUS_TK:  emitByte(OP_NEGATE);    break;
@@ -405,16 +628,24 @@ namedVariable(Token name, bool canAssign)
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = identifierGlobal(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
+    uint8_t op = getOp;
     if (canAssign && match(EQ_TK)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        op = setOp;
+    }
+
+    // Global slots take a 16-bit operand, locals and upvalues a single byte
+    // unless they need the wide form
+    if (getOp == OP_GET_GLOBAL) {
+        emitByte(op);
+        emitShort(arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitOperand(op, arg);
     }
 }
 
@@ -444,18 +675,18 @@ super_(bool canAssign)
 
     consume(DOT_TK, "Expected '.' after 'super'.");
     consume(IDENTIFIER_TK, "Expected superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
 
     if (match(LPAREN_TK)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitOperand(OP_SUPER_INVOKE, name);
         emitByte(argCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitOperand(OP_GET_SUPER, name);
     }
 }
 
@@ -517,6 +748,8 @@ static void
 parsePrecedence(Precedence precedence)
 {
     advance();
+    int start = currentChunk()->count;
+    int constants = currentChunk()->constants.count;
 
     ParseFn prefixRule = getRule(parser.previous.type)->prefix;
     if (prefixRule == NULL) {
@@ -531,18 +764,32 @@ parsePrecedence(Precedence precedence)
         advance();
 
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        operandStart = start;
+        operandConstants = constants;
         infixRule(canAssign);
     }
 
     if (canAssign && match(EQ_TK)) error("Invalid assignment target.");
 }
 
-static uint8_t
+static int
 identifierConstant(Token *name)
 {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static int
+identifierGlobal(Token *name)
+{
+    int slot = resolveGlobal(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
 static bool
 identifiersEqual(Token *a, Token *b)
 {
@@ -569,7 +816,7 @@ resolveLocal(Compiler *compiler, Token *name)
 }
 
 static int
-addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
+addUpvalue(Compiler *compiler, int index, bool isLocal)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -581,11 +828,18 @@ addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
         }
     }
 
-    if (upvalueCount == UINT8_COUNT) {
+    if (upvalueCount == UINT16_COUNT) {
         error("Too many closure variables within a function.");
         return 0;
     }
 
+    if (compiler->upvalueCapacity < upvalueCount + 1) {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity,
+                                        compiler->upvalueCapacity);
+    }
+
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
     return compiler->function->upvalueCount++;
@@ -599,12 +853,12 @@ resolveUpvalue(Compiler *compiler, Token *name)
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, local, true);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, upvalue, false);
     }
 
     return -1;
@@ -613,12 +867,12 @@ resolveUpvalue(Compiler *compiler, Token *name)
 static void
 addLocal(Token name)
 {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == UINT16_COUNT) {
         error("Too many local variables in function.");
         return;
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = newLocal(current);
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
@@ -646,7 +900,7 @@ declareVariable()
     addLocal(*name);
 }
 
-static uint8_t
+static int
 parseVariable(const char *errorMessage)
 {
     consume(IDENTIFIER_TK, errorMessage);
@@ -654,7 +908,7 @@ parseVariable(const char *errorMessage)
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierGlobal(&parser.previous);
 }
 
 static void
@@ -665,14 +919,15 @@ markInitialized()
 }
 
 static void
-defineVariable(uint8_t global)
+defineVariable(int global)
 {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitByte(OP_DEFINE_GLOBAL);
+    emitShort(global);
 }
 
 static uint8_t
@@ -793,7 +1048,7 @@ function(FunctionType type)
                 errorAtCurrent("Cannot have more than 255 parameters.");
             }
 
-            uint8_t constant = parseVariable("Expected parameter name.");
+            int constant = parseVariable("Expected parameter name.");
             defineVariable(constant);
         } while (match(COMMA_TK));
     }
@@ -803,18 +1058,37 @@ function(FunctionType type)
     block();
 
     ObjFunction *function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    int constant = makeConstant(OBJ_VAL(function));
+
+    // One operand past a byte makes every operand of the closure wide
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+    }
+
+    if (wide) {
+        emitBytes(OP_WIDE, OP_CLOSURE);
+        emitShort(constant);
+    } else {
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
+    }
 
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        if (wide) {
+            emitShort(compiler.upvalues[i].index);
+        } else {
+            emitByte((uint8_t)compiler.upvalues[i].index);
+        }
     }
+
+    freeCompiler(&compiler);
 }
 
 static void
 funDeclaration()
 {
-    uint8_t global = parseVariable("Expected function name.");
+    int global = parseVariable("Expected function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -824,7 +1098,7 @@ static void
 method()
 {
     consume(IDENTIFIER_TK, "Expected method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 &&
@@ -835,7 +1109,7 @@ method()
 
     function(type);
 
-    emitBytes(OP_METHOD, constant);
+    emitOperand(OP_METHOD, constant);
 }
 
 static void
@@ -843,11 +1117,11 @@ classDeclaration()
 {
     consume(IDENTIFIER_TK, "Expected class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitOperand(OP_CLASS, nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : identifierGlobal(&className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -931,6 +1205,13 @@ returnStatement()
 
         expression();
         consume(SEMICOLON_TK, "Expected ';' after return value.");
+
+        // A call that is the last thing the returned expression does can
+        // reuse this function's frame. OP_RETURN stays behind it for any
+        // jump in the expression that lands past the call.
+        if (current->lastCall == currentChunk()->count - 2) {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -957,7 +1238,7 @@ whileStatement()
 static void
 varDeclaration()
 {
-    uint8_t global = parseVariable("Expected variable name.");
+    int global = parseVariable("Expected variable name.");
 
     if (match(EQ_TK)) expression();
     else emitByte(OP_NIL);
@@ -1043,6 +1324,7 @@ compile(const char *source)
     }
 
     ObjFunction *function = endCompiler();
+    freeCompiler(&compiler);
     return parser.hadError ? NULL : function;
 }
 
@@ -41,7 +41,7 @@ typedef struct {
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
@@ -58,10 +58,16 @@ typedef struct Compiler {
     ObjFunction *function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    // Both grow on demand, up to UINT16_COUNT entries
+    Local *locals;
     int localCount;
-    Upvalue upvalues[UINT8_COUNT];
+    int localCapacity;
+    Upvalue *upvalues;
+    int upvalueCapacity;
     int scopeDepth;
+    ConstantIndex constants;
+
+    int lastCall;       // Offset of the latest OP_CALL, or -1
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -3,6 +3,77 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
+
+static const char *opcodeNames[] = {
+    [OP_CONSTANT]               = "OP_CONSTANT",
+    [OP_NIL]                    = "OP_NIL",
+    [OP_TRUE]                   = "OP_TRUE",
+    [OP_FALSE]                  = "OP_FALSE",
+    [OP_EQUAL]                  = "OP_EQUAL",
+    [OP_GREATER]                = "OP_GREATER",
+    [OP_LESS]                   = "OP_LESS",
+    [OP_ADD]                    = "OP_ADD",
+    [OP_SUBTRACT]               = "OP_SUBTRACT",
+    [OP_MULTIPLY]               = "OP_MULTIPLY",
+    [OP_DIVIDE]                 = "OP_DIVIDE",
+    [OP_NOT]                    = "OP_NOT",
+    [OP_NEGATE]                 = "OP_NEGATE",
+    [OP_PRINT]                  = "OP_PRINT",
+    [OP_POP]                    = "OP_POP",
+    [OP_DEFINE_GLOBAL]          = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL]             = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL]             = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL]              = "OP_GET_LOCAL",
+    [OP_SET_LOCAL]              = "OP_SET_LOCAL",
+    [OP_GET_UPVALUE]            = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE]            = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY]           = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY]           = "OP_SET_PROPERTY",
+    [OP_GET_SUPER]              = "OP_GET_SUPER",
+    [OP_JUMP]                   = "OP_JUMP",
+    [OP_JUMP_IF_FALSE]          = "OP_JUMP_IF_FALSE",
+    [OP_LOOP]                   = "OP_LOOP",
+    [OP_CALL]                   = "OP_CALL",
+    [OP_TAIL_CALL]              = "OP_TAIL_CALL",
+    [OP_INVOKE]                 = "OP_INVOKE",
+    [OP_SUPER_INVOKE]           = "OP_SUPER_INVOKE",
+    [OP_CLOSURE]                = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE]          = "OP_CLOSE_UPVALUE",
+    [OP_RETURN]                 = "OP_RETURN",
+    [OP_CLASS]                  = "OP_CLASS",
+    [OP_INHERIT]                = "OP_INHERIT",
+    [OP_METHOD]                 = "OP_METHOD",
+    [OP_WIDE]                   = "OP_WIDE",
+    [OP_EQUAL_NUM_NUM]          = "OP_EQUAL_NUM_NUM",
+    [OP_GREATER_NUM_NUM]        = "OP_GREATER_NUM_NUM",
+    [OP_LESS_NUM_NUM]           = "OP_LESS_NUM_NUM",
+    [OP_ADD_NUM_NUM]            = "OP_ADD_NUM_NUM",
+    [OP_ADD_STR_STR]            = "OP_ADD_STR_STR",
+    [OP_SUBTRACT_NUM_NUM]       = "OP_SUBTRACT_NUM_NUM",
+    [OP_MULTIPLY_NUM_NUM]       = "OP_MULTIPLY_NUM_NUM",
+    [OP_DIVIDE_NUM_NUM]         = "OP_DIVIDE_NUM_NUM",
+    [OP_NOT_EQUAL]              = "OP_NOT_EQUAL",
+    [OP_NOT_GREATER]            = "OP_NOT_GREATER",
+    [OP_NOT_LESS]               = "OP_NOT_LESS",
+    [OP_SET_LOCAL_POP]          = "OP_SET_LOCAL_POP",
+    [OP_ADD_LOCAL_LOCAL]        = "OP_ADD_LOCAL_LOCAL",
+    [OP_ADD_LOCAL_CONST]        = "OP_ADD_LOCAL_CONST",
+    [OP_SUBTRACT_LOCAL_CONST]   = "OP_SUBTRACT_LOCAL_CONST",
+    [OP_GET_LOCAL_PROPERTY]     = "OP_GET_LOCAL_PROPERTY",
+    [OP_LESS_LOCAL_CONST_JUMP]  = "OP_LESS_LOCAL_CONST_JUMP",
+};
+
+const char *
+opcodeName(uint8_t opcode)
+{
+    if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) ||
+        opcodeNames[opcode] == NULL) {
+        return "OP_UNKNOWN";
+    }
+
+    return opcodeNames[opcode];
+}
 
 static int
 byteInstruction(const char *name, Chunk *chunk, int offset)
@@ -22,6 +93,18 @@ constantInstruction(const char *name, Chunk *chunk, int offset)
     return offset + 2;
 }
 
+static int
+globalInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int
 invokeInstruction(const char *name, Chunk *chunk, int offset)
 {
@@ -33,6 +116,33 @@ invokeInstruction(const char *name, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static int
+cachedInvokeInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' [cache %d]\n", cache);
+    return offset + 5;
+}
+
+static int
+propertyInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' [cache %d]\n", cache);
+    return offset + 4;
+}
+
 static int
 jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
 {
@@ -43,6 +153,125 @@ jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static int
+localPairInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int
+localConstantInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int
+localPropertyInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' [cache %d]\n", cache);
+    return offset + 5;
+}
+
+static int
+localConstantJumpInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
+// Prints the long form of an instruction under its own name plus " (wide)"
+static int
+wideInstruction(Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    uint16_t operand = (uint16_t)(code[2] << 8 | code[3]);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%s (wide)", opcodeName(code[1]));
+    printf("%-16s ", name);
+
+    switch (code[1]) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            printf("%4d\n", operand);
+            break;
+
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP: {
+            uint32_t jump = (uint32_t)code[2] << 24 | code[3] << 16 |
+                            code[4] << 8 | code[5];
+            int sign = code[1] == OP_LOOP ? -1 : 1;
+            printf("%4d -> %d\n", offset, offset + 6 + sign * (int)jump);
+        } break;
+
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            printf("%4d '", operand);
+            printValue(chunk->constants.values[operand]);
+            printf("' [cache %d]\n", code[4] << 8 | code[5]);
+            break;
+
+        case OP_INVOKE:
+            printf("(%d args) %4d '", code[4], operand);
+            printValue(chunk->constants.values[operand]);
+            printf("' [cache %d]\n", code[5] << 8 | code[6]);
+            break;
+
+        case OP_SUPER_INVOKE:
+            printf("(%d args) %4d '", code[4], operand);
+            printValue(chunk->constants.values[operand]);
+            printf("'\n");
+            break;
+
+        case OP_CLOSURE: {
+            printf("%4d ", operand);
+            printValue(chunk->constants.values[operand]);
+            printf("\n");
+
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[operand]);
+            for (int j = 0; j < function->upvalueCount; j++) {
+                uint8_t *upvalue = &code[4 + j * 3];
+                printf("%04d    |                       %s %d\n",
+                       offset + 4 + j * 3, upvalue[0] ? "local" : "upvalue",
+                       upvalue[1] << 8 | upvalue[2]);
+            }
+        } break;
+
+        default:
+            printf("%4d '", operand);
+            printValue(chunk->constants.values[operand]);
+            printf("'\n");
+            break;
+    }
+
+    return offset + instructionLength(chunk, offset);
+}
+
 static int
 simpleInstruction(const char *name, int offset)
 {
@@ -78,21 +307,22 @@ disassembleInstruction(Chunk *chunk, int offset)
         case OP_NEGATE:         return simpleInstruction("OP_NEGATE", offset);
         case OP_PRINT:          return simpleInstruction("OP_PRINT", offset);
         case OP_POP:            return simpleInstruction("OP_POP", offset);
-        case OP_DEFINE_GLOBAL:  return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_GET_GLOBAL:     return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-        case OP_SET_GLOBAL:     return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL:  return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL:     return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL:     return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:      return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:      return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_UPVALUE:    return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:    return byteInstruction("OP_SET_UPVALUE", chunk, offset);
-        case OP_GET_PROPERTY:   return constantInstruction("OP_GET_PROPERTY", chunk, offset);
-        case OP_SET_PROPERTY:   return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_GET_PROPERTY:   return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY:   return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:      return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_JUMP:           return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:  return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:           return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:           return byteInstruction("OP_CALL", chunk, offset);
-        case OP_INVOKE:         return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_TAIL_CALL:      return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_INVOKE:         return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:   return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
 
         case OP_CLOSURE: {
@@ -119,6 +349,30 @@ disassembleInstruction(Chunk *chunk, int offset)
         case OP_CLASS:          return constantInstruction("OP_CLASS", chunk, offset);
         case OP_INHERIT:        return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:         return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_WIDE:           return wideInstruction(chunk, offset);
+
+        case OP_EQUAL_NUM_NUM:      return simpleInstruction("OP_EQUAL_NUM_NUM", offset);
+        case OP_GREATER_NUM_NUM:    return simpleInstruction("OP_GREATER_NUM_NUM", offset);
+        case OP_LESS_NUM_NUM:       return simpleInstruction("OP_LESS_NUM_NUM", offset);
+        case OP_ADD_NUM_NUM:        return simpleInstruction("OP_ADD_NUM_NUM", offset);
+        case OP_ADD_STR_STR:        return simpleInstruction("OP_ADD_STR_STR", offset);
+        case OP_SUBTRACT_NUM_NUM:   return simpleInstruction("OP_SUBTRACT_NUM_NUM", offset);
+        case OP_MULTIPLY_NUM_NUM:   return simpleInstruction("OP_MULTIPLY_NUM_NUM", offset);
+        case OP_DIVIDE_NUM_NUM:     return simpleInstruction("OP_DIVIDE_NUM_NUM", offset);
+
+        case OP_NOT_EQUAL:          return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_NOT_GREATER:        return simpleInstruction("OP_NOT_GREATER", offset);
+        case OP_NOT_LESS:           return simpleInstruction("OP_NOT_LESS", offset);
+        case OP_SET_LOCAL_POP:      return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_ADD_LOCAL_LOCAL:    return localPairInstruction("OP_ADD_LOCAL_LOCAL", chunk, offset);
+        case OP_ADD_LOCAL_CONST:
+            return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+        case OP_SUBTRACT_LOCAL_CONST:
+            return localConstantInstruction("OP_SUBTRACT_LOCAL_CONST", chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+        case OP_LESS_LOCAL_CONST_JUMP:
+            return localConstantJumpInstruction("OP_LESS_LOCAL_CONST_JUMP", chunk, offset);
 
         default: {
             printf("Unknown OpCode: %d\n", instruction);
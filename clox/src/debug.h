@@ -6,6 +6,9 @@
 int
 disassembleInstruction(Chunk *chunk, int offset);
 
+const char *
+opcodeName(uint8_t opcode);
+
 void
 disassembleChunk(Chunk *chunk, const char *name);
 
@@ -0,0 +1,535 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif // DEBUG_LOG_GC
+
+// Free slots are poisoned in ASan builds, as the sanitizer cannot tell
+// them apart from the rest of their page on its own. Mapped pages are
+// also handed to the leak checker, which would not look into them for
+// pointers to malloc'd memory otherwise.
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/lsan_interface.h>
+#define POISON(address, size)   ASAN_POISON_MEMORY_REGION(address, size)
+#define UNPOISON(address, size) ASAN_UNPOISON_MEMORY_REGION(address, size)
+#define WATCH(address, size)    __lsan_register_root_region(address, size)
+#define UNWATCH(address, size)  __lsan_unregister_root_region(address, size)
+#else
+#define POISON(address, size)   ((void)(address), (void)(size))
+#define UNPOISON(address, size) ((void)(address), (void)(size))
+#define WATCH(address, size)    ((void)(address), (void)(size))
+#define UNWATCH(address, size)  ((void)(address), (void)(size))
+#endif // __SANITIZE_ADDRESS__
+
+#define PAGE_HEADER ((sizeof(Page) + 15) & ~(size_t)15)
+#define USED_WORDS  (PAGE_SLOTS_MAX / 64)
+
+// Every object type has a class of its exact size : strings, upvalues,
+// bound methods, closures and instances with up to ten inline fields all
+// fall in the classes spaced by 8 bytes
+static const int classSizes[SIZE_CLASSES] = {
+    16,  24,  32,  40,  48,  56,  64,  72,
+    80,  88,  96,  104, 112, 120, 128, 144,
+    160, 176, 192, 224, 256, 320, 384, 448,
+    512, 576, 640, 704, 768, 896, 1024
+};
+
+uint8_t classOfSize[SMALL_OBJECT_MAX / 8 + 1];
+
+static pthread_once_t classesFilled = PTHREAD_ONCE_INIT;
+
+static void
+fillClassOfSize()
+{
+    int sizeClass = 0;
+    for (int i = 0; i <= SMALL_OBJECT_MAX / 8; i++) {
+        while (classSizes[sizeClass] < i * 8) sizeClass++;
+        classOfSize[i] = sizeClass;
+    }
+}
+
+void
+initHeap(Heap *heap)
+{
+    pthread_once(&classesFilled, fillClassOfSize);
+    memset(heap, 0, sizeof(Heap));
+}
+
+#ifdef __SANITIZE_ADDRESS__
+void
+unpoisonSlot(Page *page, FreeSlot *slot)
+{
+    UNPOISON(slot, page->slotSize);
+}
+#endif // __SANITIZE_ADDRESS__
+
+// Rebuilds the free list of a page from its used bits, lowest address first
+static void
+linkFreeSlots(Page *page)
+{
+    FreeSlot **link = &page->free;
+
+    for (int i = 0; i < USED_WORDS; i++) {
+        uint64_t bits = ~page->used[i];
+
+        while (bits != 0) {
+            int bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            FreeSlot *slot = (FreeSlot *)(page->slots +
+                (size_t)(i * 64 + bit) * page->slotSize);
+            UNPOISON(link, sizeof(FreeSlot *));
+            *link = slot;
+            if (link != &page->free) POISON(link, sizeof(FreeSlot *));
+            link = &slot->next;
+        }
+    }
+
+    UNPOISON(link, sizeof(FreeSlot *));
+    *link = NULL;
+    if (link != &page->free) POISON(link, sizeof(FreeSlot *));
+}
+
+// Pages are mapped straight from the system, so freeing one gives its
+// memory back. Mapping twice the size leaves room to trim both ends down
+// to an aligned page.
+static Page *
+mapPage()
+{
+    uint8_t *memory = mmap(NULL, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) exit(1);
+
+    uint8_t *page = (uint8_t *)(((uintptr_t)memory + PAGE_SIZE - 1) &
+                                ~(uintptr_t)(PAGE_SIZE - 1));
+    if (page > memory) munmap(memory, page - memory);
+    munmap(page + PAGE_SIZE, memory + PAGE_SIZE - page);
+
+    WATCH(page, PAGE_SIZE);
+    return (Page *)page;
+}
+
+static Page *
+newPage(int sizeClass)
+{
+    Page *page = mapPage();
+    page->next = NULL;
+    page->slots = (uint8_t *)page + PAGE_HEADER;
+    page->slotSize = classSizes[sizeClass];
+    page->slotCount = (PAGE_SIZE - PAGE_HEADER) / page->slotSize;
+    page->sizeClass = sizeClass;
+    page->usedCount = 0;
+    page->divider = (uint32_t)((((uint64_t)1 << 32) + page->slotSize - 1) /
+                               page->slotSize);
+
+    // Bits past the last slot stay set, so they never look free
+    memset(page->used, 0, sizeof(page->used));
+    memset(page->marks, 0, sizeof(page->marks));
+    for (int i = page->slotCount; i < USED_WORDS * 64; i++) {
+        page->used[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+
+    POISON(page->slots, (size_t)page->slotCount * page->slotSize);
+    linkFreeSlots(page);
+    return page;
+}
+
+static void
+freePage(Page *page)
+{
+    UNPOISON(page->slots, (size_t)page->slotCount * page->slotSize);
+
+    if (page->sizeClass < 0) {
+        free(page);
+    } else {
+        UNWATCH(page, PAGE_SIZE);
+        munmap(page, PAGE_SIZE);
+    }
+}
+
+// Frees the unmarked objects of a page and unmarks the others
+static void
+sweepObjects(Page *page)
+{
+    bool freed = false;
+
+    for (int i = 0; i < USED_WORDS; i++) {
+        uint64_t bits = page->used[i];
+
+        while (bits != 0) {
+            int bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            int index = i * 64 + bit;
+            if (index >= page->slotCount) break;
+
+            uint8_t *slot = page->slots + (size_t)index * page->slotSize;
+            Obj *object = (Obj *)slot;
+            if (page->marks[i] & ((uint64_t)1 << bit)) continue;
+
+#ifdef DEBUG_LOG_GC
+            printf("%p : Free type : %d\n", (void *)object, objType(object));
+#endif // DEBUG_LOG_GC
+
+            vm.bytesAllocated -= objectSize(object);
+            releaseObject(object);
+
+            page->used[i] &= ~((uint64_t)1 << bit);
+            page->usedCount--;
+            POISON(object, page->slotSize);
+            freed = true;
+        }
+    }
+
+    memset(page->marks, 0, sizeof(page->marks));
+    if (freed && page->sizeClass >= 0) linkFreeSlots(page);
+}
+
+// Puts a swept page back where allocation will find it, or frees it when
+// nothing in it survived
+static void
+returnPage(SizeClass *sizeClass, Page *page)
+{
+    if (page->usedCount == 0) {
+        freePage(page);
+    } else if (page->usedCount == page->slotCount) {
+        page->next = sizeClass->full;
+        sizeClass->full = page;
+    } else {
+        page->next = sizeClass->available;
+        sizeClass->available = page;
+    }
+}
+
+static Obj *
+allocateLarge(Heap *heap, size_t size)
+{
+    void *memory;
+    if (posix_memalign(&memory, PAGE_SIZE, PAGE_HEADER + size) != 0) exit(1);
+
+    Page *page = (Page *)memory;
+    page->slots = (uint8_t *)page + PAGE_HEADER;
+    page->slotSize = (int)size;
+    page->slotCount = 1;
+    page->sizeClass = -1;
+    page->usedCount = 1;
+    page->divider = 0;
+    page->free = NULL;
+    memset(page->used, 0, sizeof(page->used));
+    memset(page->marks, 0, sizeof(page->marks));
+    page->used[0] = 1;
+
+    page->next = heap->large;
+    heap->large = page;
+    return (Obj *)page->slots;
+}
+
+// Finds a page with a free slot once the first available page of a class
+// has run out. Pages left over from the last mark are swept on the way,
+// before any new page is added.
+Obj *
+heapAllocateSlow(Heap *heap, size_t size)
+{
+    if (size > SMALL_OBJECT_MAX) return allocateLarge(heap, size);
+
+    SizeClass *sizeClass = &heap->classes[classOfSize[(size + 7) / 8]];
+
+    for (;;) {
+        Page *page = sizeClass->available;
+
+        if (page != NULL && page->free != NULL) {
+            return heapAllocate(heap, size);
+        } else if (page != NULL) {
+            sizeClass->available = page->next;
+            page->next = sizeClass->full;
+            sizeClass->full = page;
+        } else if (sizeClass->unswept != NULL) {
+            page = sizeClass->unswept;
+            sizeClass->unswept = page->next;
+            heap->unsweptCount--;
+
+            sweepObjects(page);
+            returnPage(sizeClass, page);
+        } else {
+            sizeClass->available = newPage(sizeClass - heap->classes);
+        }
+    }
+}
+
+static Page *
+appendPages(Page *pages, Page *tail, int *count)
+{
+    if (pages == NULL) return tail;
+
+    Page *last = pages;
+    for (*count += 1; last->next != NULL; last = last->next) *count += 1;
+    last->next = tail;
+    return pages;
+}
+
+// Hands every page over to the sweep that follows a mark
+void
+heapStartSweep(Heap *heap)
+{
+    int count = 0;
+
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        SizeClass *sizeClass = &heap->classes[i];
+        sizeClass->unswept = appendPages(sizeClass->full, sizeClass->unswept,
+                                         &count);
+        sizeClass->unswept = appendPages(sizeClass->available,
+                                         sizeClass->unswept, &count);
+        sizeClass->available = NULL;
+        sizeClass->full = NULL;
+    }
+
+    heap->largeUnswept = appendPages(heap->large, heap->largeUnswept, &count);
+    heap->large = NULL;
+    heap->unsweptCount += count;
+}
+
+// Sweeps one page the sweep has yet to visit, if any is left
+bool
+heapSweepPage(Heap *heap)
+{
+    if (heap->largeUnswept != NULL) {
+        Page *page = heap->largeUnswept;
+        heap->largeUnswept = page->next;
+        heap->unsweptCount--;
+
+        sweepObjects(page);
+        if (page->usedCount == 0) {
+            freePage(page);
+        } else {
+            page->next = heap->large;
+            heap->large = page;
+        }
+        return true;
+    }
+
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        SizeClass *sizeClass = &heap->classes[i];
+        Page *page = sizeClass->unswept;
+        if (page == NULL) continue;
+
+        sizeClass->unswept = page->next;
+        heap->unsweptCount--;
+
+        sweepObjects(page);
+        returnPage(sizeClass, page);
+        return true;
+    }
+
+    return false;
+}
+
+// === Compaction ===
+
+// Pages of a class a compaction could do without, once the live objects
+// of the class fill the fewest pages they fit in
+static int
+sparePages(SizeClass *sizeClass)
+{
+    int pageCount = 0;
+    int usedCount = 0;
+    int slotCount = 0;
+
+    for (Page *page = sizeClass->available; page != NULL; page = page->next) {
+        pageCount++;
+        usedCount += page->usedCount;
+        slotCount = page->slotCount;
+    }
+
+    if (pageCount == 0) return 0;
+    return pageCount - (usedCount + slotCount - 1) / slotCount;
+}
+
+// Whether a compaction would free a quarter of the pages. Stress builds
+// compact as soon as it would free a single one.
+bool
+heapFragmented(Heap *heap)
+{
+    int pageCount = 0;
+    int spareCount = 0;
+
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        SizeClass *sizeClass = &heap->classes[i];
+        spareCount += sparePages(sizeClass);
+
+        for (Page *page = sizeClass->available; page != NULL;
+             page = page->next) {
+            pageCount++;
+        }
+        for (Page *page = sizeClass->full; page != NULL; page = page->next) {
+            pageCount++;
+        }
+    }
+
+#ifdef DEBUG_STRESS_GC
+    return spareCount > 0;
+#else
+    return spareCount * 4 >= pageCount && spareCount > 0;
+#endif // DEBUG_STRESS_GC
+}
+
+static int
+compareUsed(const void *a, const void *b)
+{
+    return (*(Page **)b)->usedCount - (*(Page **)a)->usedCount;
+}
+
+// Takes the emptiest pages of each class out of allocation's reach, as
+// long as the free slots of the other pages can hold their objects. Full
+// pages have nothing to give, so only available ones are considered. The
+// heap must be fully swept.
+int
+heapSelectEvacuation(Heap *heap)
+{
+    int selected = 0;
+
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        SizeClass *sizeClass = &heap->classes[i];
+        if (sparePages(sizeClass) == 0) continue;
+
+        int count = 0;
+        for (Page *page = sizeClass->available; page != NULL;
+             page = page->next) {
+            count++;
+        }
+
+        Page **pages = (Page **)malloc(sizeof(Page *) * count);
+        if (pages == NULL) exit(1);
+
+        int freeSlots = 0;
+        count = 0;
+        for (Page *page = sizeClass->available; page != NULL;
+             page = page->next) {
+            pages[count++] = page;
+            freeSlots += page->slotCount - page->usedCount;
+        }
+        qsort(pages, count, sizeof(Page *), compareUsed);
+
+        // Free slots left in the pages that stay, and objects to move
+        int moving = 0;
+        int kept = count;
+        while (kept > 1) {
+            Page *page = pages[kept - 1];
+            int keptFree = freeSlots - (page->slotCount - page->usedCount);
+            if (keptFree < moving + page->usedCount) break;
+
+            freeSlots = keptFree;
+            moving += page->usedCount;
+            kept--;
+        }
+
+        sizeClass->available = NULL;
+        for (int j = count - 1; j >= 0; j--) {
+            Page **list = j < kept ? &sizeClass->available : &heap->evacuating;
+            pages[j]->next = *list;
+            *list = pages[j];
+        }
+
+        selected += count - kept;
+        free(pages);
+    }
+
+    return selected;
+}
+
+static void
+eachObject(Page *page, void (*visit)(Obj *object))
+{
+    for (; page != NULL; page = page->next) {
+        for (int i = 0; i < USED_WORDS; i++) {
+            uint64_t bits = page->used[i];
+
+            while (bits != 0) {
+                int bit = __builtin_ctzll(bits);
+                bits &= bits - 1;
+
+                int index = i * 64 + bit;
+                if (index >= page->slotCount) break;
+
+                visit((Obj *)(page->slots + (size_t)index * page->slotSize));
+            }
+        }
+    }
+}
+
+// Hands every object of the selected pages to move(), which must copy it
+// into a fresh slot of the heap
+void
+heapEvacuate(Heap *heap, void (*move)(Obj *object))
+{
+    eachObject(heap->evacuating, move);
+}
+
+// Visits every object outside the pages being evacuated
+void
+heapEachObject(Heap *heap, void (*visit)(Obj *object))
+{
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        SizeClass *sizeClass = &heap->classes[i];
+        eachObject(sizeClass->available, visit);
+        eachObject(sizeClass->full, visit);
+        eachObject(sizeClass->unswept, visit);
+    }
+
+    eachObject(heap->large, visit);
+    eachObject(heap->largeUnswept, visit);
+}
+
+// The objects of evacuated pages live on in their copies, so the pages go
+// without releasing anything
+void
+heapFreeEvacuated(Heap *heap)
+{
+    while (heap->evacuating != NULL) {
+        Page *page = heap->evacuating;
+        heap->evacuating = page->next;
+        freePage(page);
+    }
+}
+
+static void
+freePages(Page *page)
+{
+    while (page != NULL) {
+        Page *next = page->next;
+
+        for (int i = 0; i < page->slotCount; i++) {
+            if (page->used[i / 64] & ((uint64_t)1 << (i % 64))) {
+                uint8_t *slot = page->slots + (size_t)i * page->slotSize;
+                releaseObject((Obj *)slot);
+            }
+        }
+
+        freePage(page);
+        page = next;
+    }
+}
+
+void
+freeHeap(Heap *heap)
+{
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        SizeClass *sizeClass = &heap->classes[i];
+        freePages(sizeClass->available);
+        freePages(sizeClass->full);
+        freePages(sizeClass->unswept);
+    }
+
+    freePages(heap->large);
+    freePages(heap->largeUnswept);
+    memset(heap, 0, sizeof(Heap));
+}
@@ -0,0 +1,161 @@
+#ifndef CLOX_HEAP_H
+#define CLOX_HEAP_H
+
+#include "common.h"
+#include "object.h"
+
+// Old objects live in pages of PAGE_SIZE bytes, aligned to their size.
+// Each page is cut into slots of one size class. Objects too big for any
+// class get a page of their own, aligned the same way, so masking the low
+// bits of any old object's address gives its page.
+#define PAGE_SIZE           (64 * 1024)
+#define PAGE_SLOTS_MAX      (PAGE_SIZE / 16)
+#define SIZE_CLASSES        31
+#define SMALL_OBJECT_MAX    1024    // Biggest object a slot holds
+
+typedef struct FreeSlot {
+    struct FreeSlot *next;
+} FreeSlot;
+
+typedef struct Page {
+    struct Page *next;
+    uint8_t *slots;
+    int slotSize;
+    int slotCount;
+    int sizeClass;      // -1 for a large object's page
+    int usedCount;
+    uint32_t divider;   // Turns an offset into a slot index, see slotIndex()
+    FreeSlot *free;     // In address order
+    uint64_t used[PAGE_SLOTS_MAX / 64];
+    uint64_t marks[PAGE_SLOTS_MAX / 64];  // Cleared when the page is swept
+} Page;
+
+// Pages swept since the last mark are available or full. The pages the
+// current sweep has yet to visit are unswept.
+typedef struct {
+    Page *available;
+    Page *full;
+    Page *unswept;
+} SizeClass;
+
+typedef struct {
+    SizeClass classes[SIZE_CLASSES];
+    Page *large;
+    Page *largeUnswept;
+    int unsweptCount;
+    Page *evacuating;   // Pages a compaction is moving objects out of
+} Heap;
+
+// Size class of every small size, in steps of 8 bytes. Filled in by the
+// first initHeap() and shared by every heap.
+extern uint8_t classOfSize[SMALL_OBJECT_MAX / 8 + 1];
+
+void
+initHeap(Heap *heap);
+
+void
+freeHeap(Heap *heap);
+
+Obj *
+heapAllocateSlow(Heap *heap, size_t size);
+
+void
+heapStartSweep(Heap *heap);
+
+bool
+heapSweepPage(Heap *heap);
+
+bool
+heapFragmented(Heap *heap);
+
+int
+heapSelectEvacuation(Heap *heap);
+
+void
+heapEvacuate(Heap *heap, void (*move)(Obj *object));
+
+void
+heapEachObject(Heap *heap, void (*visit)(Obj *object));
+
+void
+heapFreeEvacuated(Heap *heap);
+
+void
+unpoisonSlot(Page *page, FreeSlot *slot);
+
+// Slot sizes are at most SMALL_OBJECT_MAX and offsets below PAGE_SIZE, so
+// multiplying by the rounded up reciprocal of the size never misses
+static inline int
+slotIndex(Page *page, void *slot)
+{
+    uint64_t offset = (uint8_t *)slot - page->slots;
+    return (int)((offset * page->divider) >> 32);
+}
+
+static inline Page *
+pageOf(Obj *object)
+{
+    return (Page *)((uintptr_t)object & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+// Mark bits live in the page rather than in the object, so marking and
+// sweeping leave the objects themselves untouched
+static inline bool
+testMark(Obj *object)
+{
+    Page *page = pageOf(object);
+    int index = slotIndex(page, object);
+    return (page->marks[index / 64] >> (index % 64)) & 1;
+}
+
+// Returns whether the object was marked already
+static inline bool
+setMark(Obj *object)
+{
+    Page *page = pageOf(object);
+    int index = slotIndex(page, object);
+    uint64_t bit = (uint64_t)1 << (index % 64);
+
+    bool wasMarked = page->marks[index / 64] & bit;
+    page->marks[index / 64] |= bit;
+    return wasMarked;
+}
+
+// For marker threads, which may share a mark word
+static inline bool
+setMarkAtomic(Obj *object)
+{
+    Page *page = pageOf(object);
+    int index = slotIndex(page, object);
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    uint64_t *word = &page->marks[index / 64];
+
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return true;
+    return __atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit;
+}
+
+// Takes the first free slot of the first page with one in the object's
+// class, leaving the rest to heapAllocateSlow()
+static inline Obj *
+heapAllocate(Heap *heap, size_t size)
+{
+    if (size > SMALL_OBJECT_MAX) return heapAllocateSlow(heap, size);
+
+    Page *page = heap->classes[classOfSize[(size + 7) / 8]].available;
+    if (page == NULL || page->free == NULL) {
+        return heapAllocateSlow(heap, size);
+    }
+
+    FreeSlot *slot = page->free;
+#ifdef __SANITIZE_ADDRESS__
+    unpoisonSlot(page, slot);
+#endif // __SANITIZE_ADDRESS__
+    page->free = slot->next;
+
+    int index = slotIndex(page, slot);
+    page->used[index / 64] |= (uint64_t)1 << (index % 64);
+    page->usedCount++;
+    return (Obj *)slot;
+}
+
+#endif // CLOX_HEAP_H
@@ -0,0 +1,764 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "isolate.h"
+#include "memory.h"
+#include "serialize.h"
+#include "vm.h"
+
+// An image holds, after the header serialize.h describes :
+//
+//   object count, then the type and fields of each object
+//   global count, then the name and value of each global slot
+//
+// Objects refer to each other by their index in the file, -1 standing for
+// NULL, and values are a tag followed by a number or an index. Loading
+// turns the indexes back into pointers. Bump IMAGE_VERSION whenever this
+// layout changes.
+//
+// Messages use the same objects without the header, followed by :
+//
+//   global count and whether their values are included, then the name and
+//   maybe the value of each global slot
+//   value count, then each value
+//
+// A message holds the global names whenever it holds code, and their
+// values as well when it starts an isolate. A channel is written as its
+// address, so messages never leave the process.
+#define IMAGE_MAGIC     "LOXI"
+#define IMAGE_VERSION   3
+
+typedef enum {
+    VALUE_NIL,
+    VALUE_FALSE,
+    VALUE_TRUE,
+    VALUE_NUMBER,
+    VALUE_OBJECT,
+    VALUE_UNDEFINED
+} ValueTag;
+
+// Objects get their index the first time something refers to them, and are
+// written in that order, so the list doubles as the writer's work list.
+typedef struct {
+    Buffer buffer;
+    Obj **objects;
+    int count;
+    int capacity;
+    int *slots;         // Open addressing, holding an index + 1 or 0
+    int slotCapacity;
+    bool message;
+    bool wroteCode;
+    bool failed;
+} Writer;
+
+// Objects are read twice. The first pass allocates each one and fills in
+// everything but its references, which read as NULL and nil. The second,
+// with every object in place, reads them again and resolves them.
+typedef struct {
+    Reader reader;
+    Obj **objects;
+    int count;
+    bool message;
+    bool linking;       // Second pass
+} Loader;
+
+static uint32_t
+hashPointer(Obj *object)
+{
+    return (uint32_t)(((uintptr_t)object * 0x9e3779b97f4a7c15u) >> 32);
+}
+
+static void
+growSlots(Writer *writer)
+{
+    int capacity = writer->slotCapacity < 64 ? 64 : writer->slotCapacity * 2;
+    int *slots = (int *)calloc(capacity, sizeof(int));
+    if (slots == NULL) exit(1);
+
+    for (int i = 0; i < writer->count; i++) {
+        uint32_t slot = hashPointer(writer->objects[i]) & (capacity - 1);
+        while (slots[slot] != 0) slot = (slot + 1) & (capacity - 1);
+        slots[slot] = i + 1;
+    }
+
+    free(writer->slots);
+    writer->slots = slots;
+    writer->slotCapacity = capacity;
+}
+
+static int
+objectIndex(Writer *writer, Obj *object)
+{
+    if ((writer->count + 1) * 4 > writer->slotCapacity * 3) growSlots(writer);
+
+    uint32_t mask = writer->slotCapacity - 1;
+    uint32_t slot = hashPointer(object) & mask;
+    for (; writer->slots[slot] != 0; slot = (slot + 1) & mask) {
+        int index = writer->slots[slot] - 1;
+        if (writer->objects[index] == object) return index;
+    }
+
+    if (writer->count == writer->capacity) {
+        writer->capacity = writer->capacity < 64 ? 64 : writer->capacity * 2;
+        writer->objects = (Obj **)realloc(writer->objects,
+                                          sizeof(Obj *) * writer->capacity);
+        if (writer->objects == NULL) exit(1);
+    }
+
+    writer->objects[writer->count] = object;
+    writer->slots[slot] = writer->count + 1;
+    return writer->count++;
+}
+
+static void
+writeRef(Writer *writer, Obj *object)
+{
+    int index = object == NULL ? -1 : objectIndex(writer, object);
+    writeInt(&writer->buffer, index);
+}
+
+static void
+writeValue(Writer *writer, Value value)
+{
+    Buffer *buffer = &writer->buffer;
+
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        writeInt(buffer, VALUE_NUMBER);
+        writeBytes(buffer, &number, sizeof(number));
+    } else if (IS_OBJ(value)) {
+        writeInt(buffer, VALUE_OBJECT);
+        writeRef(writer, AS_OBJ(value));
+    } else if (IS_BOOL(value)) {
+        writeInt(buffer, AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE);
+    } else if (IS_UNDEFINED(value)) {
+        writeInt(buffer, VALUE_UNDEFINED);
+    } else {
+        writeInt(buffer, VALUE_NIL);
+    }
+}
+
+static void
+writeTable(Writer *writer, Table *table)
+{
+    int count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) count++;
+    }
+
+    writeInt(&writer->buffer, count);
+    for (int i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+
+        writeRef(writer, (Obj *)entry->key);
+        writeValue(writer, entry->value);
+    }
+}
+
+static void
+writeObject(Writer *writer, Obj *object)
+{
+    Buffer *buffer = &writer->buffer;
+    writeInt(buffer, objType(object));
+
+    switch (objType(object)) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod *bound = (ObjBoundMethod *)object;
+            writeValue(writer, bound->receiver);
+            writeRef(writer, (Obj *)bound->method);
+        } break;
+
+        case OBJ_CHANNEL: {
+            if (!writer->message) writer->failed = true;
+            writeLong(buffer, (uintptr_t)((ObjChannel *)object)->channel);
+        } break;
+
+        case OBJ_CLASS: {
+            ObjClass *klass = (ObjClass *)object;
+            writeRef(writer, (Obj *)klass->name);
+            writeRef(writer, (Obj *)klass->rootShape);
+            writeInt(buffer, klass->shapeCount);
+            writeInt(buffer, klass->inlineFields);
+            writeTable(writer, &klass->methods);
+        } break;
+
+        case OBJ_CLOSURE: {
+            ObjClosure *closure = (ObjClosure *)object;
+            writeRef(writer, (Obj *)closure->function);
+            writeInt(buffer, closure->upvalueCount);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                writeRef(writer, (Obj *)closure->upvalues[i]);
+            }
+        } break;
+
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction *)object;
+            Chunk *chunk = &function->chunk;
+
+            writer->wroteCode = true;
+            writeInt(buffer, function->arity);
+            writeInt(buffer, function->upvalueCount);
+            writeInt(buffer, function->maxSlots);
+            writeRef(writer, (Obj *)function->name);
+            writeCode(buffer, chunk);
+
+            writeInt(buffer, chunk->constants.count);
+            for (int i = 0; i < chunk->constants.count; i++) {
+                writeValue(writer, chunk->constants.values[i]);
+            }
+        } break;
+
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *)object;
+            writeRef(writer, (Obj *)instance->klass);
+            writeInt(buffer, instance->inlineCount);
+            writeInt(buffer, instance->shape == NULL);
+
+            if (instance->shape == NULL) {
+                writeTable(writer, instance->as.dictionary);
+                break;
+            }
+
+            writeRef(writer, (Obj *)instance->shape);
+            writeInt(buffer, instance->shape->fieldCount);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                writeValue(writer, *instanceSlot(instance, i));
+            }
+        } break;
+
+        case OBJ_NATIVE: {
+            int index = nativeIndex(((ObjNative *)object)->function);
+            if (index == -1) writer->failed = true;
+            writeInt(buffer, index);
+        } break;
+
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            writeRef(writer, (Obj *)shape->klass);
+            writeRef(writer, (Obj *)shape->parent);
+            writeRef(writer, (Obj *)shape->name);
+            writeInt(buffer, shape->slot);
+            writeInt(buffer, shape->fieldCount);
+            writeTable(writer, &shape->transitions);
+        } break;
+
+        case OBJ_STRING:
+            writeString(buffer, (ObjString *)object);
+            break;
+
+        case OBJ_UPVALUE: {
+            // The stack is not part of an image, so every upvalue must be
+            // closed by the time it is saved. A message takes the value an
+            // open one has when it is sent.
+            ObjUpvalue *upvalue = (ObjUpvalue *)object;
+            if (upvalue->location != &upvalue->closed && !writer->message) {
+                writer->failed = true;
+            }
+            writeValue(writer, *upvalue->location);
+        } break;
+    }
+}
+
+static void
+initWriter(Writer *writer, bool message)
+{
+    writer->objects = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+    writer->slots = NULL;
+    writer->slotCapacity = 0;
+    writer->message = message;
+    writer->wroteCode = false;
+    writer->failed = false;
+}
+
+// Everything written after the objects must already be in the work list
+static void
+writeObjects(Writer *writer)
+{
+    size_t countOffset = writer->buffer.count;
+    writeInt(&writer->buffer, 0);
+    for (int i = 0; i < writer->count; i++) {
+        writeObject(writer, writer->objects[i]);
+    }
+
+    int32_t count = writer->count;
+    memcpy(writer->buffer.data + countOffset, &count, sizeof(count));
+}
+
+bool
+saveImage(const char *path)
+{
+    Writer writer;
+    initWriter(&writer, false);
+    beginFile(&writer.buffer, IMAGE_MAGIC, IMAGE_VERSION);
+
+    // The globals come first in the work list, so every object is known by
+    // the time they are written out after the objects
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        objectIndex(&writer, AS_OBJ(vm.globalNames.values[i]));
+        Value value = vm.globalValues.values[i];
+        if (IS_OBJ(value)) objectIndex(&writer, AS_OBJ(value));
+    }
+
+    writeObjects(&writer);
+
+    writeInt(&writer.buffer, vm.globalNames.count);
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        writeRef(&writer, AS_OBJ(vm.globalNames.values[i]));
+        writeValue(&writer, vm.globalValues.values[i]);
+    }
+
+    bool saved = false;
+    if (writer.failed) {
+        free(writer.buffer.data);
+    } else {
+        saved = writeFile(&writer.buffer, path);
+    }
+
+    free(writer.objects);
+    free(writer.slots);
+    return saved;
+}
+
+uint8_t *
+packMessage(Value *values, int count, bool withGlobals, size_t *size)
+{
+    Writer writer;
+    initWriter(&writer, true);
+    writer.buffer.data = NULL;
+    writer.buffer.count = 0;
+    writer.buffer.capacity = 0;
+
+    if (withGlobals) {
+        for (int i = 0; i < vm.globalValues.count; i++) {
+            Value value = vm.globalValues.values[i];
+            if (IS_OBJ(value)) objectIndex(&writer, AS_OBJ(value));
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (IS_OBJ(values[i])) objectIndex(&writer, AS_OBJ(values[i]));
+    }
+
+    writeObjects(&writer);
+
+    // Code refers to globals by slot, so the receiver needs the names
+    bool globals = withGlobals || writer.wroteCode;
+    writeInt(&writer.buffer, globals ? vm.globalNames.count : 0);
+    writeInt(&writer.buffer, withGlobals);
+    for (int i = 0; globals && i < vm.globalNames.count; i++) {
+        writeString(&writer.buffer, AS_STRING(vm.globalNames.values[i]));
+        if (withGlobals) writeValue(&writer, vm.globalValues.values[i]);
+    }
+
+    writeInt(&writer.buffer, count);
+    for (int i = 0; i < count; i++) {
+        writeValue(&writer, values[i]);
+    }
+
+    uint8_t *message = NULL;
+    if (writer.failed) {
+        free(writer.buffer.data);
+    } else {
+        // The message holds a reference to every channel in it until it is
+        // unpacked
+        for (int i = 0; i < writer.count; i++) {
+            if (objType(writer.objects[i]) == OBJ_CHANNEL) {
+                retainChannel(((ObjChannel *)writer.objects[i])->channel);
+            }
+        }
+
+        message = writer.buffer.data;
+        *size = writer.buffer.count;
+    }
+
+    free(writer.objects);
+    free(writer.slots);
+    return message;
+}
+
+static Obj *
+objectAt(Loader *loader, int32_t index)
+{
+    if (index < 0 || index >= loader->count) {
+        loader->reader.failed = true;
+        return NULL;
+    }
+
+    return loader->objects[index];
+}
+
+static Obj *
+readRef(Loader *loader, ObjType type)
+{
+    int32_t index = readInt(&loader->reader);
+    if (!loader->linking || index == -1) return NULL;
+
+    Obj *object = objectAt(loader, index);
+    if (object != NULL && objType(object) != type) {
+        loader->reader.failed = true;
+        return NULL;
+    }
+
+    return object;
+}
+
+static Value
+readValue(Loader *loader)
+{
+    Reader *reader = &loader->reader;
+
+    switch ((ValueTag)readInt(reader)) {
+        case VALUE_NIL:         return NIL_VAL;
+        case VALUE_FALSE:       return BOOL_VAL(false);
+        case VALUE_TRUE:        return BOOL_VAL(true);
+        case VALUE_UNDEFINED:   return UNDEFINED_VAL;
+
+        case VALUE_NUMBER: {
+            double number = 0;
+            const uint8_t *bytes = readBytes(reader, sizeof(number));
+            if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+
+        case VALUE_OBJECT: {
+            int32_t index = readInt(reader);
+            if (!loader->linking) return NIL_VAL;
+
+            Obj *object = objectAt(loader, index);
+            return object == NULL ? NIL_VAL : OBJ_VAL(object);
+        }
+    }
+
+    reader->failed = true;
+    return NIL_VAL;
+}
+
+static void
+readTable(Loader *loader, Table *table)
+{
+    int32_t count = readCount(&loader->reader, 2 * sizeof(int32_t));
+    for (int i = 0; i < count; i++) {
+        ObjString *key = (ObjString *)readRef(loader, OBJ_STRING);
+        Value value = readValue(loader);
+        if (key != NULL) tableSet(table, key, value);
+    }
+}
+
+static ObjInstance *
+allocateInstance(int inlineCount, bool dictionary, int fieldCount)
+{
+    ObjInstance *instance = (ObjInstance *)allocateObject(
+        sizeof(ObjInstance) + sizeof(Value) * inlineCount, OBJ_INSTANCE
+    );
+
+    instance->inlineCount = inlineCount;
+    instance->spillCapacity = 0;
+    if (dictionary) {
+        instance->as.dictionary = ALLOCATE(Table, 1);
+        initTable(instance->as.dictionary);
+    } else if (fieldCount > inlineCount) {
+        instance->spillCapacity = fieldCount - inlineCount;
+        instance->as.spill = ALLOCATE(Value, instance->spillCapacity);
+    } else {
+        instance->as.spill = NULL;
+    }
+
+    return instance;
+}
+
+// Allocates the object in the first pass. Both passes set every field,
+// the second to its final value.
+static void
+readObject(Loader *loader, int index)
+{
+    Reader *reader = &loader->reader;
+    int32_t type = readInt(reader);
+    Obj *object = loader->linking ? loader->objects[index] : NULL;
+
+    if (type < 0 || type >= OBJ_TYPE_COUNT ||
+        (object != NULL && objType(object) != (ObjType)type)) {
+        reader->failed = true;
+        return;
+    }
+
+    switch ((ObjType)type) {
+        case OBJ_BOUND_METHOD: {
+            if (object == NULL) {
+                object = (Obj *)ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+            }
+
+            ObjBoundMethod *bound = (ObjBoundMethod *)object;
+            bound->receiver = readValue(loader);
+            bound->method = (ObjClosure *)readRef(loader, OBJ_CLOSURE);
+        } break;
+
+        case OBJ_CHANNEL: {
+            // Images never hold one, and a message hands its reference over
+            Channel *channel = (Channel *)(uintptr_t)readLong(reader);
+            if (!loader->message) {
+                reader->failed = true;
+                return;
+            }
+
+            if (object == NULL) object = (Obj *)newChannel(channel);
+        } break;
+
+        case OBJ_CLASS: {
+            if (object == NULL) {
+                object = (Obj *)ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+                initTable(&((ObjClass *)object)->methods);
+            }
+
+            ObjClass *klass = (ObjClass *)object;
+            klass->name = (ObjString *)readRef(loader, OBJ_STRING);
+            klass->rootShape = (ObjShape *)readRef(loader, OBJ_SHAPE);
+            klass->shapeCount = readInt(reader);
+            klass->inlineFields = readInt(reader);
+            readTable(loader, &klass->methods);
+        } break;
+
+        case OBJ_CLOSURE: {
+            ObjFunction *function = (ObjFunction *)readRef(loader,
+                                                           OBJ_FUNCTION);
+            int32_t upvalueCount = readCount(reader, sizeof(int32_t));
+            if (object == NULL) {
+                ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, upvalueCount);
+                object = (Obj *)ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+                ((ObjClosure *)object)->upvalues = upvalues;
+                ((ObjClosure *)object)->upvalueCount = upvalueCount;
+            }
+
+            ObjClosure *closure = (ObjClosure *)object;
+            closure->function = function;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] = (ObjUpvalue *)readRef(loader,
+                                                             OBJ_UPVALUE);
+            }
+        } break;
+
+        case OBJ_FUNCTION: {
+            if (object == NULL) object = (Obj *)newFunction();
+
+            ObjFunction *function = (ObjFunction *)object;
+            Chunk *chunk = &function->chunk;
+            function->arity = readInt(reader);
+            function->upvalueCount = readInt(reader);
+            function->maxSlots = readInt(reader);
+            function->name = (ObjString *)readRef(loader, OBJ_STRING);
+            readCode(reader, loader->linking ? NULL : chunk);
+
+            int32_t constantCount = readCount(reader, sizeof(int32_t));
+            for (int i = 0; i < constantCount; i++) {
+                Value constant = readValue(loader);
+                if (loader->linking) {
+                    writeValueArray(&chunk->constants, constant);
+                }
+            }
+        } break;
+
+        case OBJ_INSTANCE: {
+            ObjClass *klass = (ObjClass *)readRef(loader, OBJ_CLASS);
+            int32_t inlineCount = readInt(reader);
+            bool dictionary = readInt(reader);
+            ObjShape *shape = NULL;
+            int32_t fieldCount = 0;
+            if (!dictionary) {
+                shape = (ObjShape *)readRef(loader, OBJ_SHAPE);
+                fieldCount = readCount(reader, sizeof(int32_t));
+            }
+
+            if (inlineCount < 0 || inlineCount > SHAPE_MAX_FIELDS ||
+                fieldCount > SHAPE_MAX_FIELDS) {
+                reader->failed = true;
+                return;
+            }
+
+            if (object == NULL) {
+                object = (Obj *)allocateInstance(inlineCount, dictionary,
+                                                 fieldCount);
+            }
+
+            ObjInstance *instance = (ObjInstance *)object;
+            instance->klass = klass;
+            instance->shape = shape;
+            if (dictionary) {
+                readTable(loader, instance->as.dictionary);
+                break;
+            }
+
+            for (int i = 0; i < fieldCount; i++) {
+                *instanceSlot(instance, i) = readValue(loader);
+            }
+        } break;
+
+        case OBJ_NATIVE: {
+            NativeFn function = nativeAt(readInt(reader));
+            if (function == NULL) {
+                reader->failed = true;
+                return;
+            }
+
+            if (object == NULL) object = (Obj *)newNative(function);
+        } break;
+
+        case OBJ_SHAPE: {
+            if (object == NULL) {
+                object = (Obj *)ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+                initTable(&((ObjShape *)object)->transitions);
+            }
+
+            ObjShape *shape = (ObjShape *)object;
+            shape->klass = (ObjClass *)readRef(loader, OBJ_CLASS);
+            shape->parent = (ObjShape *)readRef(loader, OBJ_SHAPE);
+            shape->name = (ObjString *)readRef(loader, OBJ_STRING);
+            shape->slot = readInt(reader);
+            shape->fieldCount = readInt(reader);
+            readTable(loader, &shape->transitions);
+        } break;
+
+        case OBJ_STRING: {
+            // Interned, so the second pass finds the same string again
+            ObjString *string = readString(reader);
+            if (string == NULL ||
+                (object != NULL && object != (Obj *)string)) {
+                reader->failed = true;
+                return;
+            }
+
+            object = (Obj *)string;
+        } break;
+
+        case OBJ_UPVALUE: {
+            if (object == NULL) {
+                object = (Obj *)ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+                ObjUpvalue *upvalue = (ObjUpvalue *)object;
+                upvalue->location = &upvalue->closed;
+                upvalue->next = NULL;
+            }
+
+            ((ObjUpvalue *)object)->closed = readValue(loader);
+        } break;
+    }
+
+    loader->objects[index] = object;
+}
+
+// The names come in slot order, and a VM that has run nothing yet gives
+// them the same slots again
+static bool
+readGlobals(Loader *loader)
+{
+    int32_t count = readCount(&loader->reader, 2 * sizeof(int32_t));
+    for (int i = 0; i < count; i++) {
+        ObjString *name = (ObjString *)readRef(loader, OBJ_STRING);
+        Value value = readValue(loader);
+        if (name == NULL || resolveGlobal(name) != i) return false;
+
+        vm.globalValues.values[i] = value;
+    }
+
+    return !loader->reader.failed;
+}
+
+// Nothing may collect the objects while they are half built. They all go
+// straight to the old generation, as they mostly live as long as the
+// program does. endLoading() lets the collector run again.
+static void
+readObjects(Loader *loader)
+{
+    collectNursery();
+    vm.gcPaused = true;
+    vm.pretenure = true;
+
+    loader->count = readCount(&loader->reader, sizeof(int32_t));
+    loader->objects = (Obj **)malloc(sizeof(Obj *) * (loader->count + 1));
+    if (loader->objects == NULL) exit(1);
+
+    const uint8_t *objects = loader->reader.current;
+    for (int pass = 0; pass < 2; pass++) {
+        loader->reader.current = objects;
+        loader->linking = pass == 1;
+
+        for (int i = 0; i < loader->count && !loader->reader.failed; i++) {
+            readObject(loader, i);
+        }
+    }
+}
+
+static void
+endLoading(Loader *loader)
+{
+    vm.pretenure = false;
+    vm.gcPaused = false;
+    free(loader->objects);
+}
+
+bool
+loadImage(const char *path)
+{
+    Loader loader;
+    if (!mapFile(&loader.reader, path, IMAGE_MAGIC, IMAGE_VERSION)) {
+        return false;
+    }
+
+    loader.message = false;
+    readObjects(&loader);
+    bool loaded = !loader.reader.failed && readGlobals(&loader) &&
+                  loader.reader.current == loader.reader.end;
+
+    endLoading(&loader);
+    unmapFile(&loader.reader);
+    return loaded;
+}
+
+// Names this VM does not know yet get new slots, which only line up with
+// the sender's when neither VM has defined globals the other lacks
+static bool
+readMessageGlobals(Loader *loader)
+{
+    Reader *reader = &loader->reader;
+    int32_t count = readCount(reader, sizeof(int32_t));
+    bool withValues = readInt(reader);
+    for (int i = 0; i < count && !reader->failed; i++) {
+        ObjString *name = readString(reader);
+        if (name == NULL || resolveGlobal(name) != i) return false;
+
+        if (withValues) vm.globalValues.values[i] = readValue(loader);
+    }
+
+    return !reader->failed;
+}
+
+int
+unpackMessage(const uint8_t *message, size_t size)
+{
+    Loader loader;
+    loader.reader.start = message;
+    loader.reader.current = message;
+    loader.reader.end = message + size;
+    loader.reader.failed = false;
+    loader.message = true;
+
+    readObjects(&loader);
+    bool loaded = !loader.reader.failed && readMessageGlobals(&loader);
+
+    // The stack keeps the values alive once the collector runs again
+    int32_t count = readCount(&loader.reader, sizeof(int32_t));
+    if (count > vm.stackCapacity - (vm.stackTop - vm.stack)) loaded = false;
+    for (int i = 0; loaded && i < count; i++) {
+        push(readValue(&loader));
+    }
+
+    if (loaded && (loader.reader.failed ||
+                   loader.reader.current != loader.reader.end)) {
+        vm.stackTop -= count;
+        loaded = false;
+    }
+
+    endLoading(&loader);
+    return loaded ? count : -1;
+}
@@ -0,0 +1,30 @@
+#ifndef CLOX_IMAGE_H
+#define CLOX_IMAGE_H
+
+#include "common.h"
+#include "value.h"
+
+// A heap image holds the globals and every object they reach, so a later
+// process can start from the state a script left behind instead of running
+// it again. Images are saved once the script has finished, and loaded into
+// a VM that has run nothing yet. Both report failure by returning false;
+// a VM whose image failed to load is left unusable.
+bool
+saveImage(const char *path);
+
+bool
+loadImage(const char *path);
+
+// Messages carry values from one VM to another through memory, copying
+// everything they reach. packMessage() returns a block the caller frees,
+// or NULL when a value cannot be copied. withGlobals adds the value of
+// every global, for a VM that has run nothing yet. unpackMessage() pushes
+// the values onto the stack and returns how many, or -1 when the message
+// does not fit this VM.
+uint8_t *
+packMessage(Value *values, int count, bool withGlobals, size_t *size);
+
+int
+unpackMessage(const uint8_t *message, size_t size);
+
+#endif // CLOX_IMAGE_H
@@ -0,0 +1,288 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "image.h"
+#include "isolate.h"
+#include "memory.h"
+#include "vm.h"
+
+typedef struct Message {
+    struct Message *next;
+    uint8_t *data;
+    size_t size;
+} Message;
+
+// Messages queue up under the lock until a receiver takes them. The
+// channel spawn() returns also has the thread running the isolate, and
+// holds its result once it has finished.
+struct Channel {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // A message arrived or the isolate finished
+    Message *first;
+    Message *last;
+    int references;
+
+    bool spawned;
+    bool finished;
+    bool joined;
+    pthread_t thread;
+    Message *result;        // NULL if the isolate failed
+};
+
+// What a new isolate starts from : a message with the globals, the
+// function and its arguments, and the collector settings of its parent
+typedef struct {
+    Channel *channel;
+    Message *start;
+    int gcPause;
+    int gcThreads;
+    int gcGrowth;
+    size_t gcSoftLimit;
+    bool gcCompact;
+#ifdef JIT
+    bool jitEnabled;
+#endif // JIT
+} Isolate;
+
+static Message *
+newMessage(Value *values, int count, bool withGlobals)
+{
+    size_t size;
+    uint8_t *data = packMessage(values, count, withGlobals, &size);
+    if (data == NULL) return NULL;
+
+    Message *message = (Message *)malloc(sizeof(Message));
+    if (message == NULL) exit(1);
+
+    message->next = NULL;
+    message->data = data;
+    message->size = size;
+    return message;
+}
+
+static void
+freeMessage(Message *message)
+{
+    free(message->data);
+    free(message);
+}
+
+// Returns the one value in the message, or nil if it does not fit this VM
+static Value
+openMessage(Message *message)
+{
+    if (unpackMessage(message->data, message->size) != 1) return NIL_VAL;
+    return pop();
+}
+
+static Channel *
+createChannel(int references)
+{
+    Channel *channel = (Channel *)malloc(sizeof(Channel));
+    if (channel == NULL) exit(1);
+
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->ready, NULL);
+    channel->first = NULL;
+    channel->last = NULL;
+    channel->references = references;
+    channel->spawned = false;
+    channel->finished = false;
+    channel->joined = false;
+    channel->result = NULL;
+    return channel;
+}
+
+void
+retainChannel(Channel *channel)
+{
+    __atomic_add_fetch(&channel->references, 1, __ATOMIC_RELAXED);
+}
+
+// Channels still inside the messages left behind keep their references,
+// so a channel that was sent to itself is never freed.
+void
+releaseChannel(Channel *channel)
+{
+    // Under the lock, so that no other release can free the channel while
+    // this one still wakes a receiver waiting on the last holder but itself
+    pthread_mutex_lock(&channel->lock);
+    int left = __atomic_sub_fetch(&channel->references, 1, __ATOMIC_ACQ_REL);
+    if (left == 1) pthread_cond_broadcast(&channel->ready);
+    pthread_mutex_unlock(&channel->lock);
+    if (left > 0) return;
+
+    // The isolate has let go of the channel, so it is done or about to be
+    if (channel->spawned && !channel->joined) pthread_detach(channel->thread);
+
+    while (channel->first != NULL) {
+        Message *next = channel->first->next;
+        freeMessage(channel->first);
+        channel->first = next;
+    }
+
+    if (channel->result != NULL) freeMessage(channel->result);
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->ready);
+    free(channel);
+}
+
+static void *
+runIsolate(void *argument)
+{
+    Isolate *isolate = (Isolate *)argument;
+
+    VM machine;
+    initVM(&machine);
+    vm.gcPause = isolate->gcPause;
+    vm.gcThreads = isolate->gcThreads;
+    vm.gcGrowth = isolate->gcGrowth;
+    vm.gcSoftLimit = isolate->gcSoftLimit;
+    vm.gcCompact = isolate->gcCompact;
+#ifdef JIT
+    vm.jitEnabled = isolate->jitEnabled;
+#endif // JIT
+
+    Message *result = NULL;
+    Message *start = isolate->start;
+    int count = unpackMessage(start->data, start->size);
+    freeMessage(start);
+
+    if (count > 0 && runCall(count - 1) == INTERPRET_OK) {
+        result = newMessage(vm.stackTop - 1, 1, false);
+    }
+
+    freeVM();
+
+    Channel *channel = isolate->channel;
+    pthread_mutex_lock(&channel->lock);
+    channel->result = result;
+    channel->finished = true;
+    pthread_cond_broadcast(&channel->ready);
+    pthread_mutex_unlock(&channel->lock);
+
+    releaseChannel(channel);
+    free(isolate);
+    return NULL;
+}
+
+Value
+spawnNative(int argCount, Value *args)
+{
+    if (argCount == 0) return NIL_VAL;
+
+    Message *start = newMessage(args, argCount, true);
+    if (start == NULL) return NIL_VAL;
+
+    Isolate *isolate = (Isolate *)malloc(sizeof(Isolate));
+    if (isolate == NULL) exit(1);
+
+    // One reference for the isolate and one for the object returned
+    Channel *channel = createChannel(2);
+    channel->spawned = true;
+
+    isolate->channel = channel;
+    isolate->start = start;
+    isolate->gcPause = vm.gcPause;
+    isolate->gcThreads = vm.gcThreads;
+    isolate->gcGrowth = vm.gcGrowth;
+    isolate->gcSoftLimit = vm.gcSoftLimit;
+    isolate->gcCompact = vm.gcCompact;
+#ifdef JIT
+    isolate->jitEnabled = vm.jitEnabled;
+#endif // JIT
+
+    if (pthread_create(&channel->thread, NULL, runIsolate, isolate) != 0) {
+        channel->spawned = false;
+        releaseChannel(channel);
+        releaseChannel(channel);
+        freeMessage(start);
+        free(isolate);
+        return NIL_VAL;
+    }
+
+    return OBJ_VAL(newChannel(channel));
+}
+
+// Every join gets its own copy of the result, and the first one also
+// waits for the thread to exit
+Value
+joinNative(int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_CHANNEL(args[0])) return NIL_VAL;
+
+    Channel *channel = AS_CHANNEL(args[0]);
+    if (!channel->spawned) return NIL_VAL;
+
+    pthread_mutex_lock(&channel->lock);
+    while (!channel->finished) {
+        pthread_cond_wait(&channel->ready, &channel->lock);
+    }
+    bool first = !channel->joined;
+    channel->joined = true;
+    pthread_mutex_unlock(&channel->lock);
+
+    if (first) pthread_join(channel->thread, NULL);
+    if (channel->result == NULL) return NIL_VAL;
+    return openMessage(channel->result);
+}
+
+Value
+channelNative(int argCount, Value *args)
+{
+    return OBJ_VAL(newChannel(createChannel(1)));
+}
+
+Value
+sendNative(int argCount, Value *args)
+{
+    if (argCount != 2 || !IS_CHANNEL(args[0])) return BOOL_VAL(false);
+
+    Message *message = newMessage(&args[1], 1, false);
+    if (message == NULL) return BOOL_VAL(false);
+
+    Channel *channel = AS_CHANNEL(args[0]);
+    pthread_mutex_lock(&channel->lock);
+    if (channel->last == NULL) {
+        channel->first = message;
+    } else {
+        channel->last->next = message;
+    }
+    channel->last = message;
+    pthread_cond_broadcast(&channel->ready);
+    pthread_mutex_unlock(&channel->lock);
+
+    return BOOL_VAL(true);
+}
+
+// Waits while anything else still holds the channel and so may send on
+// it : another VM, an isolate yet to start, or a message on its way. Once
+// the receiver's own reference is the only one left, as when the isolate
+// that was to send failed or returned first, an empty channel gives nil.
+// A VM holding the channel through two objects keeps waiting.
+Value
+receiveNative(int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_CHANNEL(args[0])) return NIL_VAL;
+
+    Channel *channel = AS_CHANNEL(args[0]);
+    pthread_mutex_lock(&channel->lock);
+    while (channel->first == NULL &&
+           __atomic_load_n(&channel->references, __ATOMIC_ACQUIRE) > 1) {
+        pthread_cond_wait(&channel->ready, &channel->lock);
+    }
+
+    if (channel->first == NULL) {
+        pthread_mutex_unlock(&channel->lock);
+        return NIL_VAL;
+    }
+
+    Message *message = channel->first;
+    channel->first = message->next;
+    if (channel->first == NULL) channel->last = NULL;
+    pthread_mutex_unlock(&channel->lock);
+
+    Value value = openMessage(message);
+    freeMessage(message);
+    return value;
+}
@@ -0,0 +1,49 @@
+#ifndef CLOX_ISOLATE_H
+#define CLOX_ISOLATE_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// An isolate is a VM of its own on a thread of its own. Isolates share no
+// objects : values pass between them as messages, which copy everything
+// they reach, over channels that any number of VMs may hold.
+//
+//   spawn(fn, args...)    Runs fn(args...) in a new isolate, which starts
+//                         with a copy of every global. Returns a channel
+//                         its result arrives on, or nil.
+//   join(isolate)         Waits for the isolate and returns a copy of its
+//                         result, nil if it failed.
+//   channel()             A new channel.
+//   send(channel, value)  Queues a copy of the value, returning false if
+//                         it cannot be copied.
+//   receive(channel)      Waits for the oldest value on the channel, or
+//                         returns nil once nothing else holds it.
+//
+// Functions only work in a VM that gives the globals they use the same
+// slots, which holds for an isolate and the VM that spawned it as long as
+// only one of them defines new globals.
+
+void
+retainChannel(Channel *channel);
+
+// Frees the channel along with the last reference to it
+void
+releaseChannel(Channel *channel);
+
+Value
+spawnNative(int argCount, Value *args);
+
+Value
+joinNative(int argCount, Value *args);
+
+Value
+channelNative(int argCount, Value *args);
+
+Value
+sendNative(int argCount, Value *args);
+
+Value
+receiveNative(int argCount, Value *args);
+
+#endif // CLOX_ISOLATE_H
@@ -0,0 +1,1288 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "memory.h"
+
+#ifdef JIT
+
+// Compiled code keeps the interpreter's view of a frame in callee-saved
+// registers. Values only live in scratch registers within one instruction,
+// and the stack top is written back before every call into the VM, so the
+// collector and runtimeError() always see the real stack.
+//
+//   rbx   CallFrame *frame
+//   rbp   &vm
+//   r12   Value *stackTop
+//   r13   Value *frame->slots
+//   r14   QNAN, for number checks
+//   r15   Value *constants
+//
+// The frame's byte offset into vm.frames sits at [rsp], since a call can
+// move the whole frame array. The VM's address is built into the code, so
+// a function only runs compiled in the VM that compiled it.
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+typedef enum {
+    CC_B    = 0x2,
+    CC_E    = 0x4,
+    CC_NE   = 0x5,
+    CC_BE   = 0x6,
+    CC_A    = 0x7,
+    CC_P    = 0xa,
+    CC_NP   = 0xb,
+    CC_ALWAYS = -1
+} Condition;
+
+typedef enum {
+    ALU_ADD = 0x01,
+    ALU_OR  = 0x09,
+    ALU_AND = 0x21,
+    ALU_SUB = 0x29,
+    ALU_XOR = 0x31,
+    ALU_CMP = 0x39
+} AluOp;
+
+typedef enum {
+    SSE_ADD = 0x58,
+    SSE_MUL = 0x59,
+    SSE_SUB = 0x5c,
+    SSE_DIV = 0x5e
+} SseOp;
+
+// Where the two operands of an arithmetic or comparison instruction
+// come from. Results replace stack operands but are pushed otherwise.
+typedef enum {
+    FROM_STACK,
+    FROM_LOCALS,
+    FROM_LOCAL_CONSTANT
+} OperandSource;
+
+typedef enum {
+    COMPARE_EQUAL,
+    COMPARE_NOT_EQUAL,
+    COMPARE_GREATER,
+    COMPARE_NOT_GREATER,
+    COMPARE_LESS,
+    COMPARE_NOT_LESS
+} Comparison;
+
+typedef struct {
+    int site;           // Offset of a rel32 operand
+    int target;         // Bytecode offset it jumps to
+} JumpPatch;
+
+typedef struct {
+    Chunk *chunk;
+
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    int *labels;        // Native offset of each bytecode offset, or -1
+    JumpPatch *patches;
+    int patchCount;
+    int patchCapacity;
+
+    int errorExit;
+    int leave;
+} Assembler;
+
+typedef JitStatus (*JitEntry)(CallFrame *frame, void *entry);
+
+#define SLOT(index)     ((int)((index) * sizeof(Value)))
+
+#define VM_FRAMES       ((int)offsetof(VM, frames))
+#define VM_STACK_TOP    ((int)offsetof(VM, stackTop))
+#define VM_NURSERY_FULL ((int)offsetof(VM, nurseryFull))
+#define VM_GLOBALS                                                      \
+    ((int)(offsetof(VM, globalValues) + offsetof(ValueArray, values)))
+#define FRAME_CLOSURE   ((int)offsetof(CallFrame, closure))
+#define FRAME_IP        ((int)offsetof(CallFrame, ip))
+#define FRAME_SLOTS     ((int)offsetof(CallFrame, slots))
+#define CLOSURE_FUNCTION ((int)offsetof(ObjClosure, function))
+#define CLOSURE_UPVALUES ((int)offsetof(ObjClosure, upvalues))
+#define FUNCTION_CONSTANTS                                              \
+    ((int)(offsetof(ObjFunction, chunk) + offsetof(Chunk, constants) +  \
+           offsetof(ValueArray, values)))
+#define UPVALUE_LOCATION ((int)offsetof(ObjUpvalue, location))
+
+static _Thread_local int nesting = 0;
+
+static JitStatus
+enterFrame(CallFrame *frame)
+{
+    ObjFunction *function = frame->closure->function;
+    JitEntry entry = (JitEntry)(void *)function->jit->code;
+    int offset = (int)(frame->ip - function->chunk.code);
+    return entry(frame, function->jit->entries[offset]);
+}
+
+// Runs the frames a call pushed above depth for as long as they have
+// machine code. The caller's code then carries on as soon as they return
+// instead of going back through jitRun().
+static JitStatus
+runCallee(int depth)
+{
+    safepoint();
+    if (vm.frameCount == depth) return JIT_CONTINUE;   // Native callee
+    if (nesting == JIT_MAX_NESTING) return JIT_EXIT_FRAME;
+
+    nesting++;
+    JitStatus status = JIT_CONTINUE;
+    while (vm.frameCount > depth) {
+        CallFrame *frame = &vm.frames[vm.frameCount - 1];
+        if (frame->closure->function->jit == NULL) {
+            status = JIT_EXIT_FRAME;
+            break;
+        }
+
+        status = enterFrame(frame);
+        if (status != JIT_EXIT_FRAME) break;
+        status = JIT_CONTINUE;
+    }
+    nesting--;
+
+    return status;
+}
+
+// === Runtime helpers called from compiled code ===
+
+static void
+jitUndefinedGlobal(int slot)
+{
+    runtimeError("Undefined Variable '%s'.",
+                 AS_CSTRING(vm.globalNames.values[slot]));
+}
+
+static void
+jitNumberOperands()
+{
+    runtimeError("Operands must be numbers.");
+}
+
+static void
+jitNumberOperand()
+{
+    runtimeError("Operand must be a number.");
+}
+
+static void
+jitEqual(bool negate)
+{
+    Value b = pop();
+    Value a = pop();
+    push(BOOL_VAL(valuesEqual(a, b) != negate));
+}
+
+static void
+jitPrint()
+{
+    printValue(pop());
+    printf("\n");
+}
+
+static bool
+jitGetProperty(Value name, InlineCache *cache)
+{
+    return getProperty(AS_STRING(name), cache);
+}
+
+static bool
+jitSetProperty(Value name, InlineCache *cache)
+{
+    if (!IS_INSTANCE(vm.stackTop[-2])) {
+        runtimeError("Only instances of a class have fields.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(vm.stackTop[-2]);
+    setProperty(instance, AS_STRING(name), vm.stackTop[-1], cache);
+
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
+static bool
+jitGetSuper(Value name)
+{
+    ObjClass *superclass = AS_CLASS(pop());
+    return bindMethod(superclass, AS_STRING(name));
+}
+
+// Stores of objects leave the inline path for the write barrier
+static void
+jitSetUpvalue(int index)
+{
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    setUpvalue(frame->closure->upvalues[index], vm.stackTop[-1]);
+}
+
+static JitStatus
+jitCall(int argCount)
+{
+    int depth = vm.frameCount;
+    if (!callValue(vm.stackTop[-1 - argCount], argCount)) return JIT_EXIT_ERROR;
+    return runCallee(depth);
+}
+
+// The callee takes over this frame, so the compiled code leaves and the
+// driver runs the callee at the same depth. A native or a class without an
+// initializer called from the bottom frame leaves no frame at all.
+static JitStatus
+jitTailCall(int argCount)
+{
+    if (!tailCall(argCount)) return JIT_EXIT_ERROR;
+    if (vm.frameCount == 0) return JIT_EXIT_DONE;
+
+    safepoint();
+    return JIT_EXIT_FRAME;
+}
+
+static JitStatus
+jitInvoke(Value name, int argCount, InlineCache *cache)
+{
+    int depth = vm.frameCount;
+    if (!invoke(AS_STRING(name), argCount, cache)) return JIT_EXIT_ERROR;
+    return runCallee(depth);
+}
+
+static JitStatus
+jitSuperInvoke(Value name, int argCount)
+{
+    int depth = vm.frameCount;
+    ObjClass *superclass = AS_CLASS(pop());
+    if (!invokeFromClass(superclass, AS_STRING(name), argCount)) {
+        return JIT_EXIT_ERROR;
+    }
+    return runCallee(depth);
+}
+
+static void
+jitClosure(CallFrame *frame, uint8_t *operands)
+{
+    Chunk *chunk = &frame->closure->function->chunk;
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[*operands++]);
+    ObjClosure *closure = newClosure(function);
+    push(OBJ_VAL(closure));
+
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = *operands++;
+        uint8_t index = *operands++;
+
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        objectBarrier((Obj *)closure, (Obj *)closure->upvalues[i]);
+    }
+}
+
+static void
+jitCloseUpvalue()
+{
+    closeUpvalues(vm.stackTop - 1);
+    pop();
+}
+
+static JitStatus
+jitReturn()
+{
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    Value result = pop();
+    closeUpvalues(frame->slots);
+
+    vm.frameCount--;
+    vm.stackTop = frame->slots;
+    push(result);
+    if (vm.frameCount == 0) return JIT_EXIT_DONE;
+
+    safepoint();
+    return JIT_EXIT_FRAME;
+}
+
+static void
+jitClass(Value name)
+{
+    push(OBJ_VAL(newClass(AS_STRING(name))));
+}
+
+static bool
+jitInherit()
+{
+    Value superclass = vm.stackTop[-2];
+    if (!IS_CLASS(superclass)) {
+        runtimeError("Superclass must be a class.");
+        return false;
+    }
+
+    ObjClass *subclass = AS_CLASS(vm.stackTop[-1]);
+    inheritMethods(AS_CLASS(superclass), subclass);
+    pop(); // Subclass
+    return true;
+}
+
+static void
+jitMethod(Value name)
+{
+    defineMethod(AS_STRING(name));
+}
+
+// === Assembler ===
+
+static void
+emit8(Assembler *as, uint8_t byte)
+{
+    if (as->capacity < as->count + 1) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = realloc(as->code, as->capacity);
+        if (as->code == NULL) exit(1);
+    }
+
+    as->code[as->count++] = byte;
+}
+
+static void
+emit32(Assembler *as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) emit8(as, (value >> (i * 8)) & 0xff);
+}
+
+static void
+emit64(Assembler *as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) emit8(as, (value >> (i * 8)) & 0xff);
+}
+
+static void
+patch32(Assembler *as, int site, int32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        as->code[site + i] = ((uint32_t)value >> (i * 8)) & 0xff;
+    }
+}
+
+static void
+rex(Assembler *as, bool wide, int reg, int rm)
+{
+    uint8_t prefix = 0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+    if (prefix != 0x40) emit8(as, prefix);
+}
+
+static void
+modrmMemory(Assembler *as, int reg, Register base, int disp)
+{
+    bool shortDisp = disp >= -128 && disp <= 127;
+    emit8(as, (shortDisp ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) emit8(as, 0x24);
+
+    if (shortDisp) {
+        emit8(as, (uint8_t)disp);
+    } else {
+        emit32(as, (uint32_t)disp);
+    }
+}
+
+static void
+modrmRegister(Assembler *as, int reg, int rm)
+{
+    emit8(as, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void
+movLoad(Assembler *as, Register dst, Register base, int disp)
+{
+    rex(as, true, dst, base);
+    emit8(as, 0x8b);
+    modrmMemory(as, dst, base, disp);
+}
+
+static void
+movStore(Assembler *as, Register base, int disp, Register src)
+{
+    rex(as, true, src, base);
+    emit8(as, 0x89);
+    modrmMemory(as, src, base, disp);
+}
+
+static void
+movImmediate(Assembler *as, Register dst, uint64_t value)
+{
+    if (value <= UINT32_MAX) {
+        rex(as, false, 0, dst);
+        emit8(as, 0xb8 + (dst & 7));
+        emit32(as, (uint32_t)value);
+        return;
+    }
+
+    rex(as, true, 0, dst);
+    emit8(as, 0xb8 + (dst & 7));
+    emit64(as, value);
+}
+
+static void
+movRegister(Assembler *as, Register dst, Register src)
+{
+    rex(as, true, src, dst);
+    emit8(as, 0x89);
+    modrmRegister(as, src, dst);
+}
+
+static void
+alu(Assembler *as, AluOp op, Register dst, Register src)
+{
+    rex(as, true, src, dst);
+    emit8(as, op);
+    modrmRegister(as, src, dst);
+}
+
+// op dst, [base + disp]
+static void
+aluLoad(Assembler *as, AluOp op, Register dst, Register base, int disp)
+{
+    rex(as, true, dst, base);
+    emit8(as, op + 2);
+    modrmMemory(as, dst, base, disp);
+}
+
+static void
+addImmediate(Assembler *as, Register dst, int value)
+{
+    rex(as, true, 0, dst);
+    if (value >= -128 && value <= 127) {
+        emit8(as, 0x83);
+        modrmRegister(as, 0, dst);
+        emit8(as, (uint8_t)value);
+    } else {
+        emit8(as, 0x81);
+        modrmRegister(as, 0, dst);
+        emit32(as, (uint32_t)value);
+    }
+}
+
+static void
+pushRegister(Assembler *as, Register reg)
+{
+    rex(as, false, 0, reg);
+    emit8(as, 0x50 + (reg & 7));
+}
+
+static void
+popRegister(Assembler *as, Register reg)
+{
+    rex(as, false, 0, reg);
+    emit8(as, 0x58 + (reg & 7));
+}
+
+// movq xmm, r64
+static void
+moveToXmm(Assembler *as, int xmm, Register src)
+{
+    emit8(as, 0x66);
+    rex(as, true, xmm, src);
+    emit8(as, 0x0f);
+    emit8(as, 0x6e);
+    modrmRegister(as, xmm, src);
+}
+
+// movq r64, xmm
+static void
+moveFromXmm(Assembler *as, Register dst, int xmm)
+{
+    emit8(as, 0x66);
+    rex(as, true, xmm, dst);
+    emit8(as, 0x0f);
+    emit8(as, 0x7e);
+    modrmRegister(as, xmm, dst);
+}
+
+static void
+sse(Assembler *as, SseOp op, int dst, int src)
+{
+    emit8(as, 0xf2);
+    emit8(as, 0x0f);
+    emit8(as, op);
+    modrmRegister(as, dst, src);
+}
+
+static void
+ucomisd(Assembler *as, int a, int b)
+{
+    emit8(as, 0x66);
+    emit8(as, 0x0f);
+    emit8(as, 0x2e);
+    modrmRegister(as, a, b);
+}
+
+// setcc on one of al, cl or dl
+static void
+setCondition(Assembler *as, Condition cc, Register reg)
+{
+    emit8(as, 0x0f);
+    emit8(as, 0x90 + cc);
+    modrmRegister(as, 0, reg);
+}
+
+static void
+testAl(Assembler *as)
+{
+    emit8(as, 0x84);
+    emit8(as, 0xc0);
+}
+
+// Emits a jump with an unresolved rel32 and returns its site
+static int
+jumpForward(Assembler *as, Condition cc)
+{
+    if (cc == CC_ALWAYS) {
+        emit8(as, 0xe9);
+    } else {
+        emit8(as, 0x0f);
+        emit8(as, 0x80 + cc);
+    }
+
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static void
+patchForward(Assembler *as, int site)
+{
+    patch32(as, site, as->count - (site + 4));
+}
+
+static void
+jumpTo(Assembler *as, Condition cc, int target)
+{
+    int site = jumpForward(as, cc);
+    patch32(as, site, target - (site + 4));
+}
+
+static void
+jumpToBytecode(Assembler *as, Condition cc, int target)
+{
+    if (as->patchCapacity < as->patchCount + 1) {
+        as->patchCapacity = as->patchCapacity < 16 ? 16 : as->patchCapacity * 2;
+        as->patches = realloc(as->patches, sizeof(JumpPatch) * as->patchCapacity);
+        if (as->patches == NULL) exit(1);
+    }
+
+    JumpPatch *patch = &as->patches[as->patchCount++];
+    patch->site = jumpForward(as, cc);
+    patch->target = target;
+}
+
+// === Templates ===
+
+static void
+pushValue(Assembler *as, Register reg)
+{
+    movStore(as, R12, 0, reg);
+    addImmediate(as, R12, SLOT(1));
+}
+
+// Writes the stack top and ip back to the frame so a helper sees the same
+// state the interpreter would at the next instruction.
+static void
+syncFrame(Assembler *as, int next)
+{
+    movStore(as, RBP, VM_STACK_TOP, R12);
+    movImmediate(as, RAX, (uint64_t)(uintptr_t)&as->chunk->code[next]);
+    movStore(as, RBX, FRAME_IP, RAX);
+}
+
+static void
+callHelper(Assembler *as, void *helper)
+{
+    movImmediate(as, RAX, (uint64_t)(uintptr_t)helper);
+    emit8(as, 0xff);
+    emit8(as, 0xd0);    // call rax
+
+    // The helper may have moved either stack or thrown the stack away
+    movLoad(as, RBX, RBP, VM_FRAMES);
+    aluLoad(as, ALU_ADD, RBX, RSP, 0);
+    movLoad(as, R12, RBP, VM_STACK_TOP);
+    movLoad(as, R13, RBX, FRAME_SLOTS);
+}
+
+// After a call : keeps running unless the helper returned an exit status
+static void
+continueOrLeave(Assembler *as)
+{
+    emit8(as, 0x83);    // cmp eax, JIT_CONTINUE
+    emit8(as, 0xf8);
+    emit8(as, JIT_CONTINUE);
+    jumpTo(as, CC_NE, as->leave);
+}
+
+static void
+failUnlessAl(Assembler *as)
+{
+    testAl(as);
+    jumpTo(as, CC_E, as->errorExit);
+}
+
+// Jumps to a slow path unless reg holds a number. Clobbers rcx.
+static int
+jumpUnlessNumber(Assembler *as, Register reg)
+{
+    movRegister(as, RCX, reg);
+    alu(as, ALU_AND, RCX, R14);
+    alu(as, ALU_CMP, RCX, R14);
+    return jumpForward(as, CC_E);
+}
+
+// Jumps to a slow path if reg holds an object. Clobbers rcx and rdx.
+static int
+jumpIfObject(Assembler *as, Register reg)
+{
+    movImmediate(as, RDX, SIGN_BIT | QNAN);
+    movRegister(as, RCX, reg);
+    alu(as, ALU_AND, RCX, RDX);
+    alu(as, ALU_CMP, RCX, RDX);
+    return jumpForward(as, CC_E);
+}
+
+// Runs a pending nursery collection, as the interpreter does on back-edges
+static void
+emitSafepoint(Assembler *as, int next)
+{
+    emit8(as, 0x80);    // cmp byte [rbp + nurseryFull], 0
+    modrmMemory(as, 7, RBP, VM_NURSERY_FULL);
+    emit8(as, 0);
+    int skip = jumpForward(as, CC_E);
+
+    syncFrame(as, next);
+    callHelper(as, (void *)collectNursery);
+    patchForward(as, skip);
+}
+
+static void
+loadOperands(Assembler *as, OperandSource source, int a, int b)
+{
+    switch (source) {
+        case FROM_STACK: {
+            movLoad(as, RAX, R12, -SLOT(2));
+            movLoad(as, RDX, R12, -SLOT(1));
+        } break;
+
+        case FROM_LOCALS: {
+            movLoad(as, RAX, R13, SLOT(a));
+            movLoad(as, RDX, R13, SLOT(b));
+        } break;
+
+        case FROM_LOCAL_CONSTANT: {
+            movLoad(as, RAX, R13, SLOT(a));
+            movLoad(as, RDX, R15, SLOT(b));
+        } break;
+    }
+}
+
+static void
+storeResult(Assembler *as, OperandSource source)
+{
+    if (source == FROM_STACK) {
+        movStore(as, R12, -SLOT(2), RAX);
+        addImmediate(as, R12, -SLOT(1));
+    } else {
+        pushValue(as, RAX);
+    }
+}
+
+// Puts operands that did not come from the stack there for a helper
+static void
+spillOperands(Assembler *as, OperandSource source)
+{
+    if (source == FROM_STACK) return;
+
+    movStore(as, R12, 0, RAX);
+    movStore(as, R12, SLOT(1), RDX);
+    addImmediate(as, R12, SLOT(2));
+}
+
+static void
+emitArithmetic(Assembler *as, OperandSource source, int a, int b,
+               SseOp op, int next)
+{
+    loadOperands(as, source, a, b);
+    int slowA = jumpUnlessNumber(as, RAX);
+    int slowB = jumpUnlessNumber(as, RDX);
+
+    moveToXmm(as, 0, RAX);
+    moveToXmm(as, 1, RDX);
+    sse(as, op, 0, 1);
+    moveFromXmm(as, RAX, 0);
+    storeResult(as, source);
+    int done = jumpForward(as, CC_ALWAYS);
+
+    patchForward(as, slowA);
+    patchForward(as, slowB);
+    if (op == SSE_ADD) {
+        spillOperands(as, source);
+        syncFrame(as, next);
+        callHelper(as, (void *)addValues);
+        failUnlessAl(as);
+    } else {
+        syncFrame(as, next);
+        callHelper(as, (void *)jitNumberOperands);
+        jumpTo(as, CC_ALWAYS, as->errorExit);
+    }
+
+    patchForward(as, done);
+}
+
+// Leaves the boolean result of comparing xmm0 with xmm1 in rax
+static void
+emitCompareFlags(Assembler *as, Comparison comparison)
+{
+    switch (comparison) {
+        case COMPARE_EQUAL: {
+            ucomisd(as, 0, 1);
+            setCondition(as, CC_E, RAX);
+            setCondition(as, CC_NP, RCX);
+            emit8(as, 0x20);    // and al, cl
+            emit8(as, 0xc8);
+        } break;
+
+        case COMPARE_NOT_EQUAL: {
+            ucomisd(as, 0, 1);
+            setCondition(as, CC_NE, RAX);
+            setCondition(as, CC_P, RCX);
+            emit8(as, 0x08);    // or al, cl
+            emit8(as, 0xc8);
+        } break;
+
+        // Unordered operands set CF and ZF, so a NaN fails both a and b
+        case COMPARE_GREATER:       ucomisd(as, 0, 1); setCondition(as, CC_A, RAX);  break;
+        case COMPARE_NOT_GREATER:   ucomisd(as, 0, 1); setCondition(as, CC_BE, RAX); break;
+        case COMPARE_LESS:          ucomisd(as, 1, 0); setCondition(as, CC_A, RAX);  break;
+        case COMPARE_NOT_LESS:      ucomisd(as, 1, 0); setCondition(as, CC_BE, RAX); break;
+    }
+
+    emit8(as, 0x0f);    // movzx eax, al
+    emit8(as, 0xb6);
+    emit8(as, 0xc0);
+    movImmediate(as, RCX, FALSE_VAL);
+    alu(as, ALU_ADD, RAX, RCX);
+}
+
+static void
+emitComparison(Assembler *as, OperandSource source, Comparison comparison,
+               int next)
+{
+    loadOperands(as, source, 0, 0);
+    int slowA = jumpUnlessNumber(as, RAX);
+    int slowB = jumpUnlessNumber(as, RDX);
+
+    moveToXmm(as, 0, RAX);
+    moveToXmm(as, 1, RDX);
+    emitCompareFlags(as, comparison);
+    storeResult(as, source);
+    int done = jumpForward(as, CC_ALWAYS);
+
+    patchForward(as, slowA);
+    patchForward(as, slowB);
+    syncFrame(as, next);
+    if (comparison == COMPARE_EQUAL || comparison == COMPARE_NOT_EQUAL) {
+        movImmediate(as, RDI, comparison == COMPARE_NOT_EQUAL);
+        callHelper(as, (void *)jitEqual);
+    } else {
+        callHelper(as, (void *)jitNumberOperands);
+        jumpTo(as, CC_ALWAYS, as->errorExit);
+    }
+
+    patchForward(as, done);
+}
+
+// Jumps to target when rax holds nil or false. Clobbers rcx.
+static void
+jumpIfFalsey(Assembler *as, int target)
+{
+    movImmediate(as, RCX, NIL_VAL);
+    alu(as, ALU_CMP, RAX, RCX);
+    jumpToBytecode(as, CC_E, target);
+    movImmediate(as, RCX, FALSE_VAL);
+    alu(as, ALU_CMP, RAX, RCX);
+    jumpToBytecode(as, CC_E, target);
+}
+
+static void
+loadGlobals(Assembler *as)
+{
+    movLoad(as, RCX, RBP, VM_GLOBALS);
+}
+
+// Loads the location of upvalue index into rcx
+static void
+loadUpvalue(Assembler *as, int index)
+{
+    movLoad(as, RCX, RBX, FRAME_CLOSURE);
+    movLoad(as, RCX, RCX, CLOSURE_UPVALUES);
+    movLoad(as, RCX, RCX, SLOT(index));
+    movLoad(as, RCX, RCX, UPVALUE_LOCATION);
+}
+
+static void
+emitPrologue(Assembler *as)
+{
+    pushRegister(as, RBP);
+    pushRegister(as, RBX);
+    pushRegister(as, R12);
+    pushRegister(as, R13);
+    pushRegister(as, R14);
+    pushRegister(as, R15);
+    addImmediate(as, RSP, -8);      // Keeps helper calls 16-byte aligned
+
+    movRegister(as, RBX, RDI);
+    movImmediate(as, RBP, (uint64_t)(uintptr_t)&vm);
+    movRegister(as, RAX, RDI);
+    aluLoad(as, ALU_SUB, RAX, RBP, VM_FRAMES);
+    movStore(as, RSP, 0, RAX);
+    movLoad(as, R12, RBP, VM_STACK_TOP);
+    movLoad(as, R13, RBX, FRAME_SLOTS);
+    movImmediate(as, R14, QNAN);
+    movLoad(as, R15, RBX, FRAME_CLOSURE);
+    movLoad(as, R15, R15, CLOSURE_FUNCTION);
+    movLoad(as, R15, R15, FUNCTION_CONSTANTS);
+
+    emit8(as, 0xff);    // jmp rsi
+    emit8(as, 0xe6);
+
+    as->errorExit = as->count;
+    movImmediate(as, RAX, JIT_EXIT_ERROR);
+
+    as->leave = as->count;
+    movStore(as, RBP, VM_STACK_TOP, R12);
+    addImmediate(as, RSP, 8);
+    popRegister(as, R15);
+    popRegister(as, R14);
+    popRegister(as, R13);
+    popRegister(as, R12);
+    popRegister(as, RBX);
+    popRegister(as, RBP);
+    emit8(as, 0xc3);    // ret
+}
+
+static uint16_t
+readShort(uint8_t *code)
+{
+    return (uint16_t)(code[0] << 8 | code[1]);
+}
+
+// Emits the template of one instruction. Returns false for an instruction
+// the compiler does not handle, which keeps the function interpreted.
+static bool
+emitInstruction(Assembler *as, int offset, int next)
+{
+    Chunk *chunk = as->chunk;
+    uint8_t *code = &chunk->code[offset];
+
+    switch (code[0]) {
+        case OP_CONSTANT: {
+            movLoad(as, RAX, R15, SLOT(code[1]));
+            pushValue(as, RAX);
+        } break;
+
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            Value value = code[0] == OP_NIL ? NIL_VAL
+                        : BOOL_VAL(code[0] == OP_TRUE);
+            movImmediate(as, RAX, value);
+            pushValue(as, RAX);
+        } break;
+
+        case OP_EQUAL:
+        case OP_EQUAL_NUM_NUM:      emitComparison(as, FROM_STACK, COMPARE_EQUAL, next);        break;
+        case OP_NOT_EQUAL:          emitComparison(as, FROM_STACK, COMPARE_NOT_EQUAL, next);    break;
+        case OP_GREATER:
+        case OP_GREATER_NUM_NUM:    emitComparison(as, FROM_STACK, COMPARE_GREATER, next);      break;
+        case OP_NOT_GREATER:        emitComparison(as, FROM_STACK, COMPARE_NOT_GREATER, next);  break;
+        case OP_LESS:
+        case OP_LESS_NUM_NUM:       emitComparison(as, FROM_STACK, COMPARE_LESS, next);         break;
+        case OP_NOT_LESS:           emitComparison(as, FROM_STACK, COMPARE_NOT_LESS, next);     break;
+
+        case OP_ADD:
+        case OP_ADD_NUM_NUM:
+        case OP_ADD_STR_STR:        emitArithmetic(as, FROM_STACK, 0, 0, SSE_ADD, next); break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM_NUM:   emitArithmetic(as, FROM_STACK, 0, 0, SSE_SUB, next); break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM_NUM:   emitArithmetic(as, FROM_STACK, 0, 0, SSE_MUL, next); break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM_NUM:     emitArithmetic(as, FROM_STACK, 0, 0, SSE_DIV, next); break;
+
+        case OP_ADD_LOCAL_LOCAL: {
+            emitArithmetic(as, FROM_LOCALS, code[1], code[2], SSE_ADD, next);
+        } break;
+
+        case OP_ADD_LOCAL_CONST: {
+            emitArithmetic(as, FROM_LOCAL_CONSTANT, code[1], code[2], SSE_ADD, next);
+        } break;
+
+        case OP_SUBTRACT_LOCAL_CONST: {
+            emitArithmetic(as, FROM_LOCAL_CONSTANT, code[1], code[2], SSE_SUB, next);
+        } break;
+
+        case OP_NOT: {
+            movLoad(as, RAX, R12, -SLOT(1));
+            movImmediate(as, RCX, NIL_VAL);
+            alu(as, ALU_CMP, RAX, RCX);
+            setCondition(as, CC_E, RDX);
+            movImmediate(as, RCX, FALSE_VAL);
+            alu(as, ALU_CMP, RAX, RCX);
+            setCondition(as, CC_E, RAX);
+            emit8(as, 0x08);    // or al, dl
+            emit8(as, 0xd0);
+            emit8(as, 0x0f);    // movzx eax, al
+            emit8(as, 0xb6);
+            emit8(as, 0xc0);
+            alu(as, ALU_ADD, RAX, RCX);
+            movStore(as, R12, -SLOT(1), RAX);
+        } break;
+
+        case OP_NEGATE: {
+            movLoad(as, RAX, R12, -SLOT(1));
+            int slow = jumpUnlessNumber(as, RAX);
+            movImmediate(as, RCX, SIGN_BIT);
+            alu(as, ALU_XOR, RAX, RCX);
+            movStore(as, R12, -SLOT(1), RAX);
+            int done = jumpForward(as, CC_ALWAYS);
+
+            patchForward(as, slow);
+            syncFrame(as, next);
+            callHelper(as, (void *)jitNumberOperand);
+            jumpTo(as, CC_ALWAYS, as->errorExit);
+            patchForward(as, done);
+        } break;
+
+        case OP_PRINT: {
+            syncFrame(as, next);
+            callHelper(as, (void *)jitPrint);
+        } break;
+
+        case OP_POP:    addImmediate(as, R12, -SLOT(1)); break;
+
+        case OP_DEFINE_GLOBAL: {
+            loadGlobals(as);
+            movLoad(as, RAX, R12, -SLOT(1));
+            movStore(as, RCX, SLOT(readShort(&code[1])), RAX);
+            addImmediate(as, R12, -SLOT(1));
+        } break;
+
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+            int slot = readShort(&code[1]);
+            loadGlobals(as);
+            movLoad(as, RAX, RCX, SLOT(slot));
+            movImmediate(as, RDX, UNDEFINED_VAL);
+            alu(as, ALU_CMP, RAX, RDX);
+            int slow = jumpForward(as, CC_E);
+
+            if (code[0] == OP_GET_GLOBAL) {
+                pushValue(as, RAX);
+            } else {
+                movLoad(as, RAX, R12, -SLOT(1));
+                movStore(as, RCX, SLOT(slot), RAX);
+            }
+            int done = jumpForward(as, CC_ALWAYS);
+
+            patchForward(as, slow);
+            syncFrame(as, next);
+            movImmediate(as, RDI, slot);
+            callHelper(as, (void *)jitUndefinedGlobal);
+            jumpTo(as, CC_ALWAYS, as->errorExit);
+            patchForward(as, done);
+        } break;
+
+        case OP_GET_LOCAL: {
+            movLoad(as, RAX, R13, SLOT(code[1]));
+            pushValue(as, RAX);
+        } break;
+
+        case OP_SET_LOCAL: {
+            movLoad(as, RAX, R12, -SLOT(1));
+            movStore(as, R13, SLOT(code[1]), RAX);
+        } break;
+
+        case OP_SET_LOCAL_POP: {
+            movLoad(as, RAX, R12, -SLOT(1));
+            movStore(as, R13, SLOT(code[1]), RAX);
+            addImmediate(as, R12, -SLOT(1));
+        } break;
+
+        case OP_GET_UPVALUE: {
+            loadUpvalue(as, code[1]);
+            movLoad(as, RAX, RCX, 0);
+            pushValue(as, RAX);
+        } break;
+
+        case OP_SET_UPVALUE: {
+            movLoad(as, RAX, R12, -SLOT(1));
+            int slow = jumpIfObject(as, RAX);
+            loadUpvalue(as, code[1]);
+            movStore(as, RCX, 0, RAX);
+            int done = jumpForward(as, CC_ALWAYS);
+
+            patchForward(as, slow);
+            syncFrame(as, next);
+            movImmediate(as, RDI, code[1]);
+            callHelper(as, (void *)jitSetUpvalue);
+            patchForward(as, done);
+        } break;
+
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_GET_PROPERTY: {
+            if (code[0] == OP_GET_LOCAL_PROPERTY) {
+                movLoad(as, RAX, R13, SLOT(code[1]));
+                pushValue(as, RAX);
+                code++;
+            }
+
+            syncFrame(as, next);
+            movLoad(as, RDI, R15, SLOT(code[1]));
+            movImmediate(as, RSI,
+                         (uint64_t)(uintptr_t)&chunk->caches[readShort(&code[2])]);
+            callHelper(as, (void *)jitGetProperty);
+            failUnlessAl(as);
+        } break;
+
+        case OP_SET_PROPERTY: {
+            syncFrame(as, next);
+            movLoad(as, RDI, R15, SLOT(code[1]));
+            movImmediate(as, RSI,
+                         (uint64_t)(uintptr_t)&chunk->caches[readShort(&code[2])]);
+            callHelper(as, (void *)jitSetProperty);
+            failUnlessAl(as);
+        } break;
+
+        case OP_GET_SUPER: {
+            syncFrame(as, next);
+            movLoad(as, RDI, R15, SLOT(code[1]));
+            callHelper(as, (void *)jitGetSuper);
+            failUnlessAl(as);
+        } break;
+
+        case OP_JUMP: {
+            jumpToBytecode(as, CC_ALWAYS, next + readShort(&code[1]));
+        } break;
+
+        case OP_JUMP_IF_FALSE: {
+            movLoad(as, RAX, R12, -SLOT(1));
+            jumpIfFalsey(as, next + readShort(&code[1]));
+        } break;
+
+        case OP_LOOP: {
+            emitSafepoint(as, next);
+            jumpToBytecode(as, CC_ALWAYS, next - readShort(&code[1]));
+        } break;
+
+        case OP_LESS_LOCAL_CONST_JUMP: {
+            loadOperands(as, FROM_LOCAL_CONSTANT, code[1], code[2]);
+            int slowA = jumpUnlessNumber(as, RAX);
+            int slowB = jumpUnlessNumber(as, RDX);
+
+            moveToXmm(as, 0, RAX);
+            moveToXmm(as, 1, RDX);
+            ucomisd(as, 1, 0);
+            jumpToBytecode(as, CC_BE, next + readShort(&code[3]));
+            int done = jumpForward(as, CC_ALWAYS);
+
+            patchForward(as, slowA);
+            patchForward(as, slowB);
+            syncFrame(as, next);
+            callHelper(as, (void *)jitNumberOperands);
+            jumpTo(as, CC_ALWAYS, as->errorExit);
+            patchForward(as, done);
+        } break;
+
+        // Calls leave compiled code so the new frame runs in whatever
+        // form it has. A return comes back through the caller's entry.
+        case OP_CALL: {
+            syncFrame(as, next);
+            movImmediate(as, RDI, code[1]);
+            callHelper(as, (void *)jitCall);
+            continueOrLeave(as);
+        } break;
+
+        case OP_TAIL_CALL: {
+            syncFrame(as, next);
+            movImmediate(as, RDI, code[1]);
+            callHelper(as, (void *)jitTailCall);
+            jumpTo(as, CC_ALWAYS, as->leave);
+        } break;
+
+        case OP_INVOKE: {
+            syncFrame(as, next);
+            movLoad(as, RDI, R15, SLOT(code[1]));
+            movImmediate(as, RSI, code[2]);
+            movImmediate(as, RDX,
+                         (uint64_t)(uintptr_t)&chunk->caches[readShort(&code[3])]);
+            callHelper(as, (void *)jitInvoke);
+            continueOrLeave(as);
+        } break;
+
+        case OP_SUPER_INVOKE: {
+            syncFrame(as, next);
+            movLoad(as, RDI, R15, SLOT(code[1]));
+            movImmediate(as, RSI, code[2]);
+            callHelper(as, (void *)jitSuperInvoke);
+            continueOrLeave(as);
+        } break;
+
+        case OP_CLOSURE: {
+            syncFrame(as, next);
+            movRegister(as, RDI, RBX);
+            movImmediate(as, RSI, (uint64_t)(uintptr_t)&code[1]);
+            callHelper(as, (void *)jitClosure);
+        } break;
+
+        case OP_CLOSE_UPVALUE: {
+            syncFrame(as, next);
+            callHelper(as, (void *)jitCloseUpvalue);
+        } break;
+
+        case OP_RETURN: {
+            syncFrame(as, next);
+            callHelper(as, (void *)jitReturn);
+            jumpTo(as, CC_ALWAYS, as->leave);
+        } break;
+
+        case OP_CLASS: {
+            syncFrame(as, next);
+            movLoad(as, RDI, R15, SLOT(code[1]));
+            callHelper(as, (void *)jitClass);
+        } break;
+
+        case OP_INHERIT: {
+            syncFrame(as, next);
+            callHelper(as, (void *)jitInherit);
+            failUnlessAl(as);
+        } break;
+
+        case OP_METHOD: {
+            syncFrame(as, next);
+            movLoad(as, RDI, R15, SLOT(code[1]));
+            callHelper(as, (void *)jitMethod);
+        } break;
+
+        default: return false;
+    }
+
+    return true;
+}
+
+static void
+freeAssembler(Assembler *as)
+{
+    free(as->code);
+    free(as->labels);
+    free(as->patches);
+}
+
+bool
+jitCompile(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+
+    Assembler as;
+    as.chunk = chunk;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.patches = NULL;
+    as.patchCount = 0;
+    as.patchCapacity = 0;
+    as.labels = malloc(sizeof(int) * (chunk->count + 1));
+    if (as.labels == NULL) exit(1);
+    for (int i = 0; i <= chunk->count; i++) as.labels[i] = -1;
+
+    emitPrologue(&as);
+
+    for (int offset = 0; offset < chunk->count;) {
+        int next = offset + instructionLength(chunk, offset);
+        as.labels[offset] = as.count;
+
+        if (!emitInstruction(&as, offset, next)) {
+            freeAssembler(&as);
+            return false;
+        }
+
+        offset = next;
+    }
+
+    for (int i = 0; i < as.patchCount; i++) {
+        JumpPatch *patch = &as.patches[i];
+        patch32(&as, patch->site,
+                as.labels[patch->target] - (patch->site + 4));
+    }
+
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t)as.count + pageSize - 1) / pageSize * pageSize;
+    uint8_t *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        freeAssembler(&as);
+        return false;
+    }
+
+    memcpy(memory, as.code, as.count);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        freeAssembler(&as);
+        return false;
+    }
+
+    JitCode *jit = malloc(sizeof(JitCode));
+    void **entries = malloc(sizeof(void *) * chunk->count);
+    if (jit == NULL || entries == NULL) exit(1);
+
+    for (int i = 0; i < chunk->count; i++) {
+        entries[i] = as.labels[i] == -1 ? NULL : memory + as.labels[i];
+    }
+
+    jit->code = memory;
+    jit->size = size;
+    jit->entries = entries;
+    jit->entryCount = chunk->count;
+    function->jit = jit;
+
+    freeAssembler(&as);
+    return true;
+}
+
+void
+jitFree(ObjFunction *function)
+{
+    JitCode *jit = function->jit;
+    if (jit == NULL) return;
+
+    munmap(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+    function->jit = NULL;
+}
+
+JitStatus
+jitRun()
+{
+    for (;;) {
+        CallFrame *frame = &vm.frames[vm.frameCount - 1];
+        if (frame->closure->function->jit == NULL) return JIT_EXIT_FRAME;
+
+        JitStatus status = enterFrame(frame);
+        if (status != JIT_EXIT_FRAME) return status;
+    }
+}
+
+#endif // JIT
@@ -0,0 +1,48 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Calls plus loop back-edges a function runs before it is compiled. Build
+// with EXTRA=-DJIT_THRESHOLD=1 to compile every function on its first call.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif // JIT_THRESHOLD
+
+// Deepest native nesting of compiled calls before they fall back to
+// returning through jitRun()
+#define JIT_MAX_NESTING 256
+
+typedef enum {
+    JIT_EXIT_FRAME,     // The top frame changed and may need the interpreter
+    JIT_EXIT_DONE,      // The bottom frame returned
+    JIT_EXIT_ERROR,     // A runtime error was reported
+    JIT_CONTINUE        // Internal : a call returned into compiled code
+} JitStatus;
+
+// Machine code for one function. Every instruction boundary in the chunk is
+// an entry point, so a frame can switch to compiled code wherever its ip is.
+struct JitCode {
+    uint8_t *code;
+    size_t size;
+    void **entries;     // Native address of each bytecode offset
+    int entryCount;
+};
+
+bool
+jitCompile(ObjFunction *function);
+
+void
+jitFree(ObjFunction *function);
+
+// Runs frames that have machine code until the top frame has none
+JitStatus
+jitRun();
+
+#endif // JIT
+
+#endif // CLOX_JIT_H
@@ -1,12 +1,28 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "image.h"
+#include "memory.h"
+#include "optimizer.h"
 #include "vm.h"
 
+// Sequences listed by --fusion-report
+#define REPORT_SEQUENCES 40
+
+static bool showStats = false;
+static bool useCache = true;
+static const char *imagePath = NULL;
+static const char *saveImagePath = NULL;
+
 static void
 repl()
 {
@@ -22,6 +38,8 @@ repl()
 
         interpret(line);
     }
+
+    if (showStats) printGcStats();
 }
 
 static char *
@@ -54,29 +72,227 @@ readFile(const char *path)
     return buffer;
 }
 
+// Bytecode for foo.lox is cached in foo.loxc, and for any other file name
+// in that name with .loxc appended
+static char *
+cachePath(const char *path)
+{
+    size_t length = strlen(path);
+    bool isLox = length >= 4 && strcmp(path + length - 4, ".lox") == 0;
+
+    char *cache = (char *)malloc(length + 6);
+    if (cache == NULL) exit(1);
+    sprintf(cache, "%s%s", path, isLox ? "c" : ".loxc");
+    return cache;
+}
+
 static void
 runFile(const char *path)
 {
     char *source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result;
+    if (useCache) {
+        char *cache = cachePath(path);
+        result = interpretCached(source, cache);
+        free(cache);
+    } else {
+        result = interpret(source);
+    }
     free(source);
 
+#ifdef COUNT_INSTRUCTIONS
+    fprintf(stderr, "Instructions: %llu\n",
+            (unsigned long long)vm.instructionCount);
+#endif // COUNT_INSTRUCTIONS
+
+    if (showStats) printGcStats();
+
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Compiles every file without running it and prints the instruction
+// sequences seen most often, to help pick superinstructions.
+static void
+fusionReport(int count, char **paths)
+{
+    beginSequenceReport();
+
+    for (int i = 0; i < count; i++) {
+        char *source = readFile(paths[i]);
+        if (compile(source) == NULL) {
+            fprintf(stderr, "Could not compile '%s'.\n", paths[i]);
+        }
+        free(source);
+    }
+
+    printSequenceReport(REPORT_SEQUENCES);
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "Usage: clox [--jit | --no-jit] [--no-cache] [--stats] "
+                    "[--gc-compact] [--gc-<setting>=<value>...]\n"
+                    "            [--image=<file>] [--save-image=<file>] "
+                    "[script]\n"
+                    "       clox --fusion-report <scripts...>\n"
+                    "GC settings, also read from CLOX_GC_<SETTING> :\n"
+                    "  pause=<us> threads=<n> growth=<percent> "
+                    "limit=<bytes> start=<bytes>\n");
+    exit(64);
+}
+
+// Reads a byte count, with an optional K, M or G suffix. Counts too big
+// for a size_t are rejected rather than wrapped.
+static bool
+parseSize(const char *text, size_t *size)
+{
+    if (!isdigit((unsigned char)*text)) return false;
+
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno == ERANGE || value > SIZE_MAX) return false;
+
+    int shift = 0;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+    }
+
+    if (*end != '\0' || value > SIZE_MAX >> shift) return false;
+    *size = (size_t)value << shift;
+    return true;
+}
+
+static bool
+parseInt(const char *text, int min, int max, int *number)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE) return false;
+    if (value < min || value > max) return false;
+
+    *number = (int)value;
+    return true;
+}
+
+static const char *gcSettings[] = {
+    "pause", "threads", "growth", "limit", "start"
+};
+
+static bool
+setGcSetting(const char *name, const char *value)
+{
+    if (strcmp(name, "pause") == 0) {
+        return parseInt(value, 0, INT_MAX, &vm.gcPause);
+    } else if (strcmp(name, "threads") == 0) {
+        return parseInt(value, 1, GC_THREADS_MAX, &vm.gcThreads);
+    } else if (strcmp(name, "growth") == 0) {
+        return parseInt(value, 1, INT_MAX, &vm.gcGrowth);
+    } else if (strcmp(name, "limit") == 0) {
+        return parseSize(value, &vm.gcSoftLimit);
+    } else if (strcmp(name, "start") == 0) {
+        return parseSize(value, &vm.nextGC);
+    }
+
+    return false;
+}
+
+// The environment sets the collector up first, so flags override it
+static void
+readGcEnvironment()
+{
+    for (size_t i = 0; i < sizeof(gcSettings) / sizeof(gcSettings[0]); i++) {
+        char variable[32] = "CLOX_GC_";
+        for (int j = 0; gcSettings[i][j] != '\0'; j++) {
+            variable[8 + j] = toupper((unsigned char)gcSettings[i][j]);
+        }
+
+        const char *value = getenv(variable);
+        if (value != NULL && !setGcSetting(gcSettings[i], value)) {
+            fprintf(stderr, "Invalid value for %s.\n", variable);
+            exit(64);
+        }
+    }
+}
+
+// Takes a --gc-<setting>=<value> flag
+static bool
+gcFlag(const char *option)
+{
+    const char *equals = strchr(option, '=');
+    if (equals == NULL) return false;
+
+    char name[16];
+    size_t length = equals - (option + 5);
+    if (length >= sizeof(name)) return false;
+
+    memcpy(name, option + 5, length);
+    name[length] = '\0';
+    return setGcSetting(name, equals + 1);
+}
+
 int
 main(int argc, char **argv)
 {
-    initVM();
+    VM machine;
+    initVM(&machine);
+    readGcEnvironment();
 
-    switch (argc) {
-        case 1: repl();             break;
-        case 2: runFile(argv[1]);   break;
-        default: {
-            fprintf(stderr, "Usage: clox <script>\n");
-            exit(64);
-        } break;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        const char *option = argv[arg];
+
+        if (strcmp(option, "--fusion-report") == 0) {
+            fusionReport(argc - arg - 1, argv + arg + 1);
+            freeVM();
+            return 0;
+        } else if (strcmp(option, "--jit") == 0) {
+#ifdef JIT
+            vm.jitEnabled = true;
+#else
+            fprintf(stderr, "This build of clox has no JIT.\n");
+#endif // JIT
+        } else if (strcmp(option, "--no-jit") == 0) {
+#ifdef JIT
+            vm.jitEnabled = false;
+#endif // JIT
+        } else if (strncmp(option, "--image=", 8) == 0) {
+            imagePath = option + 8;
+        } else if (strncmp(option, "--save-image=", 13) == 0) {
+            saveImagePath = option + 13;
+        } else if (strcmp(option, "--no-cache") == 0) {
+            useCache = false;
+        } else if (strcmp(option, "--stats") == 0) {
+            showStats = true;
+        } else if (strcmp(option, "--gc-compact") == 0) {
+            vm.gcCompact = true;
+        } else if (strncmp(option, "--gc-", 5) == 0) {
+            if (!gcFlag(option)) usage();
+        } else {
+            usage();
+        }
+    }
+
+    if (argc - arg > 1) usage();
+
+    if (imagePath != NULL && !loadImage(imagePath)) {
+        fprintf(stderr, "Could not load image '%s'.\n", imagePath);
+        exit(74);
+    }
+
+    switch (argc - arg) {
+        case 0: repl();             break;
+        case 1: runFile(argv[arg]); break;
+    }
+
+    if (saveImagePath != NULL && !saveImage(saveImagePath)) {
+        fprintf(stderr, "Could not save image '%s'.\n", saveImagePath);
+        exit(74);
     }
 
     freeVM();
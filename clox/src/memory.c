@@ -1,15 +1,35 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "isolate.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif // DEBUG_LOG_GC
 
-#define GC_HEAP_GROW_FACTOR 2
+// Bytes the program may allocate between two slices of a cycle
+#define GC_STEP_SIZE (64 * 1024)
+
+// Objects marked or swept between two looks at the clock. Stress builds
+// run a single unit per slice, kept small so cycles span many slices.
+#ifdef DEBUG_STRESS_GC
+#define GC_WORK_UNIT 4
+#else
+#define GC_WORK_UNIT 64
+#endif // DEBUG_STRESS_GC
+
+// Objects in the nursery start on 8-byte boundaries
+#define ALIGN(size) (((size) + 7) & ~(size_t)7)
 
 void *
 reallocate(void *pointer, size_t oldSize, size_t newSize)
@@ -17,11 +37,11 @@ reallocate(void *pointer, size_t oldSize, size_t newSize)
     vm.bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        collectStep();
 #endif // DEBUG_STRESS_GC
 
         if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+            collectStep();
         }
     }
 
@@ -36,20 +56,64 @@ reallocate(void *pointer, size_t oldSize, size_t newSize)
     return result;
 }
 
+// Old objects come from the page heap, but count toward the next slice
+// like any other allocation
+Obj *
+allocateOld(size_t size)
+{
+    vm.bytesAllocated += size;
+
+#ifdef DEBUG_STRESS_GC
+    collectStep();
+#endif // DEBUG_STRESS_GC
+
+    if (vm.bytesAllocated > vm.nextGC) {
+        collectStep();
+    }
+
+    return heapAllocate(&vm.heap, size);
+}
+
+Obj *
+allocateYoung(size_t size)
+{
+#ifdef DEBUG_STRESS_GC
+    collectStep();
+    vm.nurseryFull = true;
+#endif // DEBUG_STRESS_GC
+
+    size = ALIGN(size);
+    if (size > (size_t)(vm.nursery + NURSERY_SIZE - vm.nurseryTop)) {
+        vm.nurseryFull = true;
+        return NULL;
+    }
+
+    Obj *object = (Obj *)vm.nurseryTop;
+    vm.nurseryTop += size;
+    return object;
+}
+
 void
-markObject(Obj *object)
+rememberObject(Obj *object)
 {
-    if (object == NULL) return;
-    if (object->isMarked) return;
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj **)realloc(vm.remembered,
+                                        sizeof(Obj *) * vm.rememberedCapacity);
 
-#ifdef DEBUG_LOG_GC
-    printf("%p : Mark ", (void *)object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
-#endif // DEBUG_LOG_GC
+        if (vm.remembered == NULL) exit(1);
+    }
 
-    object->isMarked = true;
+    setRemembered(object, true);
+    vm.remembered[vm.rememberedCount++] = object;
+}
 
+// The gray stack also holds the objects a nursery collection has copied
+// but not yet scanned. It grows outside reallocate(), so pushing never
+// starts a collection.
+void
+pushGray(Obj *object)
+{
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
         vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
@@ -60,6 +124,82 @@ markObject(Obj *object)
     vm.grayStack[vm.grayCount++] = object;
 }
 
+// Marking threads, see "Parallel marking" below
+typedef struct {
+    Obj **objects;
+    int count;
+    int capacity;
+} MarkStack;
+
+typedef struct {
+    struct MarkerPool *pool;
+    pthread_t thread;
+    MarkStack local;
+    MarkStack shared;
+    pthread_mutex_t lock;   // Guards shared
+} Marker;
+
+struct MarkerPool {
+    VM *owner;              // Helpers mark for this VM
+    int count;              // Markers, the collecting thread's first
+    Marker *markers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // Helpers wait here for a job
+    pthread_cond_t done;    // The collecting thread waits for the helpers
+    unsigned job;
+    int running;            // Helpers still in the current job
+    bool shutdown;
+
+    // Updated atomically during a job
+    int idle;               // Markers out of work
+    bool stop;              // The slice ran out of budget
+};
+
+// The marker of the current thread while a parallel job is under way
+static _Thread_local Marker *currentMarker = NULL;
+
+static void
+pushMark(MarkStack *stack, Obj *object)
+{
+    if (stack->capacity < stack->count + 1) {
+        stack->capacity = GROW_CAPACITY(stack->capacity);
+        stack->objects = (Obj **)realloc(stack->objects,
+                                         sizeof(Obj *) * stack->capacity);
+
+        if (stack->objects == NULL) exit(1);
+    }
+
+    stack->objects[stack->count++] = object;
+}
+
+void
+markObject(Obj *object)
+{
+    if (object == NULL) return;
+
+    // Young objects are all scanned when marking finishes
+    if (isYoung(object)) return;
+
+    if (currentMarker != NULL) {
+        // Other markers may reach the same object at the same time
+        if (setMarkAtomic(object)) return;
+
+        pushMark(&currentMarker->local, object);
+        return;
+    }
+
+    if (setMark(object)) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p : Mark ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif // DEBUG_LOG_GC
+
+    pushGray(object);
+}
+
 void
 markValue(Value value)
 {
@@ -74,6 +214,25 @@ markArray(ValueArray *array)
     }
 }
 
+static void
+markCaches(Chunk *chunk)
+{
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache *cache = &chunk->caches[i];
+
+        for (int j = 0; j < cache->count; j++) {
+            CacheEntry *entry = &cache->entries[j];
+            markObject((Obj *)entry->shape);
+
+            if (entry->kind == CACHE_METHOD) {
+                markObject((Obj *)entry->as.method);
+            } else if (entry->kind == CACHE_TRANSITION) {
+                markObject((Obj *)entry->as.transition);
+            }
+        }
+    }
+}
+
 static void
 blackenObject(Obj *object)
 {
@@ -83,7 +242,7 @@ blackenObject(Obj *object)
     printf("\n");
 #endif // DEBUG_LOG_GC
 
-    switch (object->type) {
+    switch (objType(object)) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound = (ObjBoundMethod *)object;
             markValue(bound->receiver);
@@ -93,6 +252,7 @@ blackenObject(Obj *object)
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *)object;
             markObject((Obj *)klass->name);
+            markObject((Obj *)klass->rootShape);
             markTable(&klass->methods);
         } break;
 
@@ -109,14 +269,33 @@ blackenObject(Obj *object)
             ObjFunction *function = (ObjFunction *)object;
             markObject((Obj *)function->name);
             markArray(&function->chunk.constants);
+            markCaches(&function->chunk);
         } break;
 
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
             markObject((Obj *)instance->klass);
-            markTable(&instance->fields);
+
+            if (instance->shape == NULL) {
+                markTable(instance->as.dictionary);
+                break;
+            }
+
+            markObject((Obj *)instance->shape);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                markValue(*instanceSlot(instance, i));
+            }
         } break;
 
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            markObject((Obj *)shape->klass);
+            markObject((Obj *)shape->parent);
+            markObject((Obj *)shape->name);
+            markTable(&shape->transitions);
+        } break;
+
+        case OBJ_CHANNEL:
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
@@ -127,55 +306,81 @@ blackenObject(Obj *object)
     }
 }
 
-static void
-freeObject(Obj *object)
+size_t
+objectSize(Obj *object)
 {
-#ifdef DEBUG_LOG_GC
-    printf("%p : Free type : %d\n", (void *)object, object->type);
-#endif // DEBUG_LOG_GC
+    switch (objType(object)) {
+        case OBJ_BOUND_METHOD:  return sizeof(ObjBoundMethod);
+        case OBJ_CHANNEL:       return sizeof(ObjChannel);
+        case OBJ_CLASS:         return sizeof(ObjClass);
+        case OBJ_CLOSURE:       return sizeof(ObjClosure);
+        case OBJ_FUNCTION:      return sizeof(ObjFunction);
+        case OBJ_NATIVE:        return sizeof(ObjNative);
+        case OBJ_SHAPE:         return sizeof(ObjShape);
+        case OBJ_UPVALUE:       return sizeof(ObjUpvalue);
 
-    switch (object->type) {
-        case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *)object;
+            return sizeof(ObjInstance) + sizeof(Value) * instance->inlineCount;
+        }
+
+        case OBJ_STRING: {
+            return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+        }
+    }
+
+    __builtin_unreachable();
+}
+
+// Frees the memory an object owns outside of itself
+void
+releaseObject(Obj *object)
+{
+    vm.stats.objectsFreed[objType(object)]++;
+    vm.stats.bytesFreed[objType(object)] += objectSize(object);
+
+    switch (objType(object)) {
+        case OBJ_CHANNEL: {
+            releaseChannel(((ObjChannel *)object)->channel);
         } break;
 
         case OBJ_CLASS: {
-            ObjClass *klass = (ObjClass *)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeTable(&((ObjClass *)object)->methods);
         } break;
 
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *)object;
             FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
         } break;
 
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *)object;
+#ifdef JIT
+            jitFree(function);
+#endif // JIT
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
         } break;
 
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
-        } break;
 
-        case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            if (instance->shape == NULL) {
+                freeTable(instance->as.dictionary);
+                FREE(Table, instance->as.dictionary);
+            } else {
+                FREE_ARRAY(Value, instance->as.spill, instance->spillCapacity);
+            }
         } break;
 
-        case OBJ_STRING: {
-            ObjString *string = (ObjString *)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        case OBJ_SHAPE: {
+            freeTable(&((ObjShape *)object)->transitions);
         } break;
 
-        case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
-        } break;
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+        case OBJ_UPVALUE:
+            break;
     }
 }
 
@@ -197,14 +402,297 @@ markRoots()
         markObject((Obj *)upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalNames);
+    markArray(&vm.globalValues);
     markCompilerRoots();
     markObject((Obj *)vm.initString);
 }
 
+static uint64_t
+clockMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static bool
+sliceOver(uint64_t start)
+{
+    // A cycle that falls too far behind the program's allocations finishes
+    // in one go, and so does one that finds the heap past the soft limit
+    if (vm.bytesAllocated > vm.gcLimit) return false;
+    if (vm.gcSoftLimit > 0 && vm.bytesAllocated > vm.gcSoftLimit) {
+        return false;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    return true;
+#else
+    return vm.gcPause > 0 && clockMicros() - start >= (uint64_t)vm.gcPause;
+#endif // DEBUG_STRESS_GC
+}
+
+// Times the program waits on a collector. A nursery collection may run a
+// slice of the old generation's, which counts as part of the same pause.
+static _Thread_local int pauseDepth = 0;
+static _Thread_local uint64_t pauseStart;
+
+static void
+beginPause()
+{
+    if (pauseDepth++ == 0) pauseStart = clockMicros();
+}
+
+static void
+endPause()
+{
+    if (--pauseDepth > 0) return;
+
+    uint64_t pause = clockMicros() - pauseStart;
+    vm.stats.pauses++;
+    vm.stats.pauseTotal += pause;
+    if (pause > vm.stats.pauseMax) vm.stats.pauseMax = pause;
+}
+
+// === Parallel marking ===
+//
+// With more than one GC thread, marking inside a slice is shared between
+// the collecting thread and helper threads. Each marker works off a
+// private stack, and moves half of it to a shared one when another marker
+// runs out of work, for that one to steal.
+
+// Takes half the shared objects of the first marker found with any,
+// starting with the thief itself
+static bool
+stealMarks(Marker *self)
+{
+    struct MarkerPool *pool = self->pool;
+    int first = (int)(self - pool->markers);
+
+    for (int i = 0; i < pool->count; i++) {
+        Marker *victim = &pool->markers[(first + i) % pool->count];
+
+        pthread_mutex_lock(&victim->lock);
+        int taken = (victim->shared.count + 1) / 2;
+        for (int j = 0; j < taken; j++) {
+            pushMark(&self->local, victim->shared.objects[--victim->shared.count]);
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (taken > 0) return true;
+    }
+
+    return false;
+}
+
+static void
+shareMarks(Marker *self)
+{
+    pthread_mutex_lock(&self->lock);
+    if (self->shared.count == 0) {
+        for (int half = self->local.count / 2; half > 0; half--) {
+            pushMark(&self->shared, self->local.objects[--self->local.count]);
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+// Marks until every marker is out of work, or the collecting thread finds
+// the slice over budget
+static void
+runMarker(Marker *self, bool budgeted, uint64_t start)
+{
+    struct MarkerPool *pool = self->pool;
+    bool collecting = self == pool->markers;
+    currentMarker = self;
+
+    for (;;) {
+        int work = 0;
+        while (self->local.count > 0) {
+            blackenObject(self->local.objects[--self->local.count]);
+            if (++work < GC_WORK_UNIT) continue;
+            work = 0;
+
+            if (__atomic_load_n(&pool->stop, __ATOMIC_RELAXED)) goto stopped;
+            if (collecting && budgeted && sliceOver(start)) {
+                __atomic_store_n(&pool->stop, true, __ATOMIC_RELAXED);
+                goto stopped;
+            }
+
+            if (__atomic_load_n(&pool->idle, __ATOMIC_RELAXED) > 0) {
+                shareMarks(self);
+            }
+        }
+
+        if (stealMarks(self)) continue;
+
+        // Nobody makes work for an idle marker, so once all of them are
+        // idle at the same time, marking is done
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&pool->stop, __ATOMIC_RELAXED)) goto stopped;
+            if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == pool->count) {
+                goto stopped;
+            }
+
+            sched_yield();
+            __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+            if (stealMarks(self)) break;
+            __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+
+stopped:
+    currentMarker = NULL;
+}
+
+static void *
+helperThread(void *argument)
+{
+    Marker *self = (Marker *)argument;
+    struct MarkerPool *pool = self->pool;
+    unsigned seen = 0;
+
+    currentVM = pool->owner;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->job == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        seen = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        runMarker(self, false, 0);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void
+freeMarkStacks(Marker *marker)
+{
+    free(marker->local.objects);
+    free(marker->shared.objects);
+    pthread_mutex_destroy(&marker->lock);
+}
+
+// Falls back on marking alone if the threads cannot be started
+static void
+startMarkers(int count)
+{
+    struct MarkerPool *pool = (struct MarkerPool *)malloc(sizeof(*pool));
+    Marker *markers = (Marker *)calloc(count, sizeof(Marker));
+    if (pool == NULL || markers == NULL) exit(1);
+
+    pool->owner = currentVM;
+    pool->count = count;
+    pool->markers = markers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->job = 0;
+    pool->running = 0;
+    pool->shutdown = false;
+    vm.markers = pool;
+
+    for (int i = 0; i < count; i++) {
+        markers[i].pool = pool;
+        pthread_mutex_init(&markers[i].lock, NULL);
+
+        if (i > 0 && pthread_create(&markers[i].thread, NULL,
+                                    helperThread, &markers[i]) != 0) {
+            freeMarkStacks(&markers[i]);
+            pool->count = i;
+            break;
+        }
+    }
+
+    if (pool->count == 1) vm.gcThreads = 1;
+}
+
+static void
+stopMarkers()
+{
+    struct MarkerPool *pool = vm.markers;
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->count; i++) {
+        if (i > 0) pthread_join(pool->markers[i].thread, NULL);
+        freeMarkStacks(&pool->markers[i]);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool->markers);
+    free(pool);
+    vm.markers = NULL;
+}
+
+// Drains the gray stack with every marker. Objects left when the budget
+// runs out go back on it.
+static void
+markInParallel(bool budgeted, uint64_t start)
+{
+    if (vm.markers == NULL) startMarkers(vm.gcThreads);
+
+    struct MarkerPool *pool = vm.markers;
+    for (int i = 0; vm.grayCount > 0; i++) {
+        pushMark(&pool->markers[i % pool->count].local,
+                 vm.grayStack[--vm.grayCount]);
+    }
+
+    pool->idle = 0;
+    pool->stop = false;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job++;
+    pool->running = pool->count - 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    runMarker(&pool->markers[0], budgeted, start);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->count; i++) {
+        Marker *marker = &pool->markers[i];
+        while (marker->local.count > 0) {
+            pushGray(marker->local.objects[--marker->local.count]);
+        }
+        while (marker->shared.count > 0) {
+            pushGray(marker->shared.objects[--marker->shared.count]);
+        }
+    }
+}
+
+// Small amounts of work are not worth waking the helpers for
+static bool
+worthSharing()
+{
+    return vm.gcThreads > 1 && vm.grayCount > GC_WORK_UNIT;
+}
+
 static void
 traceReferences()
 {
+    if (worthSharing()) markInParallel(false, 0);
+
     while (vm.grayCount > 0) {
         Obj *object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
@@ -212,62 +700,589 @@ traceReferences()
 }
 
 static void
-sweep()
-{
-    Obj *previous = NULL;
-    Obj *object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            Obj *unreached = object;
-            object = object->next;
+markSome(uint64_t start)
+{
+    if (worthSharing()) {
+        markInParallel(true, start);
+        return;
+    }
 
-            if (previous != NULL) {
-                previous ->next = object;
-            } else {
-                vm.objects = object;
-            }
+    for (int work = 0; work < GC_WORK_UNIT && vm.grayCount > 0; work++) {
+        blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+}
+
+static Obj *
+nextYoung(Obj *object)
+{
+    return (Obj *)((uint8_t *)object + ALIGN(objectSize(object)));
+}
 
-            freeObject(unreached);
+// Drops remembered objects the sweep is about to free
+static void
+pruneRemembered()
+{
+    int count = 0;
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        if (testMark(vm.remembered[i])) {
+            vm.remembered[count++] = vm.remembered[i];
         }
     }
+
+    vm.rememberedCount = count;
 }
 
+// Roots and young objects have no write barrier, so marking ends with an
+// atomic pass that scans them again. Dead young objects keep what they
+// point to alive until the next cycle.
+static void
+finishMarking()
+{
+    markRoots();
+
+    for (Obj *object = (Obj *)vm.nursery;
+         (uint8_t *)object < vm.nurseryTop;
+         object = nextYoung(object)
+    ) {
+        if (objLink(object) == NULL) blackenObject(object);
+    }
+
+    traceReferences();
+    tableRemoveWhite(&vm.strings);
+    pruneRemembered();
+
+    // Pages are swept as allocation needs them, and in later slices
+    heapStartSweep(&vm.heap);
+    vm.gcPhase = GC_SWEEP;
+}
+
+// Heap size at which the next cycle starts. The heap may grow by
+// vm.gcGrowth percent of what survived, but a soft limit takes over once
+// set : well under it, the heap may also take half the room left, and it
+// never grows past it. Over the limit, cycles follow each other with just
+// enough room in between for the program to make progress.
+static size_t
+pace()
+{
+    size_t live = vm.bytesAllocated;
+    size_t goal = live + live / 100 * vm.gcGrowth;
+
+    if (vm.gcSoftLimit > 0) {
+        size_t room = live < vm.gcSoftLimit ? vm.gcSoftLimit - live : 0;
+        if (goal < live + room / 2) goal = live + room / 2;
+        if (goal > vm.gcSoftLimit) goal = vm.gcSoftLimit;
+    }
+
+    if (goal < live + GC_STEP_SIZE) goal = live + GC_STEP_SIZE;
+    return goal;
+}
+
+static void
+endCycle()
+{
+    vm.gcPhase = GC_IDLE;
+    vm.stats.cycles++;
+    vm.stats.heapAfterGC = vm.bytesAllocated;
+}
+
+// Runs one slice of the old generation's collector, starting a cycle if
+// none is under way. Objects allocated in the old generation while marking
+// start out gray, and the write barrier marks what marked objects come to
+// point to, so nothing reachable is left unmarked between slices.
 void
-collectGarbage()
+collectStep()
 {
+    if (vm.gcPaused) return;
+
 #ifdef DEBUG_LOG_GC
-    printf("--> Begin Garbage Collection\n");
+    printf("--> Begin Collection Step : phase %d\n", vm.gcPhase);
     size_t before = vm.bytesAllocated;
 #endif // DEBUG_LOG_GC
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    beginPause();
+    uint64_t start = clockMicros();
+
+    if (vm.gcPhase == GC_IDLE) {
+        vm.gcPhase = GC_MARK;
+        vm.gcLimit = vm.bytesAllocated +
+                     vm.bytesAllocated / 100 * vm.gcGrowth;
+        markRoots();
+    }
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm.gcPhase == GC_MARK) {
+        do {
+            markSome(start);
+        } while (vm.grayCount > 0 && !sliceOver(start));
+
+        if (vm.grayCount == 0) finishMarking();
+        vm.stats.markTotal += clockMicros() - start;
+    } else {
+        while (heapSweepPage(&vm.heap)) {
+            if (sliceOver(start)) break;
+        }
+
+        if (vm.heap.unsweptCount == 0) {
+            endCycle();
+
+            // Objects only move at safepoints
+            if (vm.gcCompact && heapFragmented(&vm.heap)) {
+                vm.compactDue = true;
+                vm.nurseryFull = true;
+            }
+        }
+    }
+
+    if (vm.gcPhase == GC_IDLE) {
+        vm.nextGC = pace();
+    } else {
+        vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+    }
+
+    endPause();
 
 #ifdef DEBUG_LOG_GC
-    printf("<-- End Garbage Collection\n");
+    printf("<-- End Collection Step\n");
     printf("    Collected %zu bytes : (from %zu to %zu) : next at %zu\n",
            before - vm.bytesAllocated, before, vm.bytesAllocated,
            vm.nextGC);
 #endif // DEBUG_LOG_GC
 }
 
+// === Nursery collection ===
+//
+// Copies every young object reachable from the roots or from a remembered
+// old object into the old generation, then empties the nursery. A young
+// object that has been copied points to its copy through its link.
+
+// Copies an object into a new slot of the page heap. It keeps its old
+// address as a forwarding pointer for the rest of the references to it.
+// Not through allocateOld(), which could start a collection slice.
+static Obj *
+moveObject(Obj *object)
+{
+    size_t size = objectSize(object);
+    Obj *copy = heapAllocate(&vm.heap, size);
+
+    memcpy(copy, object, size);
+    setObjLink(object, copy);
+
+    // A closed upvalue points at its own closed field
+    if (objType(object) == OBJ_UPVALUE) {
+        ObjUpvalue *upvalue = (ObjUpvalue *)copy;
+        if (upvalue->location == &((ObjUpvalue *)object)->closed) {
+            upvalue->location = &upvalue->closed;
+        }
+    }
+
+    return copy;
+}
+
+// Moves a young object to the old generation
+static Obj *
+copyToOld(Obj *object)
+{
+    Obj *copy = moveObject(object);
+    vm.bytesAllocated += objectSize(copy);
+    if (vm.gcPhase == GC_MARK) setMark(copy);
+
+#ifdef DEBUG_LOG_GC
+    printf("%p : Promote to %p\n", (void *)object, (void *)copy);
+#endif // DEBUG_LOG_GC
+
+    return copy;
+}
+
+// Promotes an object ahead of the next nursery collection. The caller must
+// replace the references to it that it knows of; the collection forwards
+// the others. Only for objects that no longer change, as the copy alone
+// sees later stores.
+Obj *
+tenureObject(Obj *object)
+{
+    if (!isYoung(object)) return object;
+
+    if (objLink(object) != NULL) return objLink(object);
+
+    Obj *copy = copyToOld(object);
+    rememberObject(copy);
+    if (vm.gcPhase == GC_MARK) pushGray(copy);
+    return copy;
+}
+
+static Obj *
+promoteObject(Obj *object)
+{
+    Obj *copy = copyToOld(object);
+    pushGray(copy);
+    return copy;
+}
+
+// Set while a compaction forwards references to the old objects it moved
+static _Thread_local bool evacuating = false;
+
+static Obj *
+forwardObject(Obj *object)
+{
+    if (object == NULL) return object;
+
+    if (!isYoung(object)) {
+        if (evacuating && objLink(object) != NULL) return objLink(object);
+        return object;
+    }
+
+    if (objLink(object) != NULL) return objLink(object);
+    return promoteObject(object);
+}
+
+#define FORWARD(field)  ((field) = (void *)forwardObject((Obj *)(field)))
+
+static void
+forwardValue(Value *slot)
+{
+    if (IS_OBJ(*slot) && (evacuating || isYoung(AS_OBJ(*slot)))) {
+        *slot = OBJ_VAL(forwardObject(AS_OBJ(*slot)));
+    }
+}
+
+static void
+forwardArray(ValueArray *array)
+{
+    for (int i = 0; i < array->count; i++) {
+        forwardValue(&array->values[i]);
+    }
+}
+
+// Keys keep their hash when they move, so every entry stays in its bucket
+static void
+forwardTable(Table *table)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        FORWARD(entry->key);
+        forwardValue(&entry->value);
+    }
+}
+
+static void
+forwardCaches(Chunk *chunk)
+{
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache *cache = &chunk->caches[i];
+
+        for (int j = 0; j < cache->count; j++) {
+            CacheEntry *entry = &cache->entries[j];
+            FORWARD(entry->shape);
+
+            if (entry->kind == CACHE_METHOD) {
+                FORWARD(entry->as.method);
+            } else if (entry->kind == CACHE_TRANSITION) {
+                FORWARD(entry->as.transition);
+            }
+        }
+    }
+}
+
+// Fields that only ever point to old objects matter to compactions alone
+static void
+forwardFields(Obj *object)
+{
+    switch (objType(object)) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod *bound = (ObjBoundMethod *)object;
+            forwardValue(&bound->receiver);
+            FORWARD(bound->method);
+        } break;
+
+        case OBJ_CLASS: {
+            ObjClass *klass = (ObjClass *)object;
+            FORWARD(klass->name);
+            FORWARD(klass->rootShape);
+            forwardTable(&klass->methods);
+        } break;
+
+        case OBJ_CLOSURE: {
+            ObjClosure *closure = (ObjClosure *)object;
+            FORWARD(closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                FORWARD(closure->upvalues[i]);
+            }
+        } break;
+
+        // Inline caches never hold young objects
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction *)object;
+            FORWARD(function->name);
+            forwardArray(&function->chunk.constants);
+            if (evacuating) forwardCaches(&function->chunk);
+        } break;
+
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *)object;
+            FORWARD(instance->klass);
+
+            if (instance->shape == NULL) {
+                forwardTable(instance->as.dictionary);
+                break;
+            }
+
+            FORWARD(instance->shape);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                forwardValue(instanceSlot(instance, i));
+            }
+        } break;
+
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            FORWARD(shape->klass);
+            FORWARD(shape->parent);
+            FORWARD(shape->name);
+            forwardTable(&shape->transitions);
+        } break;
+
+        case OBJ_UPVALUE: {
+            forwardValue(&((ObjUpvalue *)object)->closed);
+        } break;
+
+        case OBJ_CHANNEL:
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+static void
+forwardRoots()
+{
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+        forwardValue(slot);
+    }
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        FORWARD(vm.frames[i].closure);
+    }
+
+    FORWARD(vm.openUpvalues);
+    for (ObjUpvalue *upvalue = vm.openUpvalues;
+         upvalue != NULL;
+         upvalue = upvalue->next
+    ) {
+        FORWARD(upvalue->next);
+    }
+
+    forwardTable(&vm.globalSlots);
+    forwardArray(&vm.globalNames);
+    forwardArray(&vm.globalValues);
+    FORWARD(vm.initString);
+}
+
+// Interned strings are weak : the ones left behind in the nursery leave
+// the table.
+static void
+forwardStrings()
+{
+    for (int i = 0; i < vm.strings.capacity; i++) {
+        Entry *entry = &vm.strings.entries[i];
+        if (entry->key == NULL || !isYoung((Obj *)entry->key)) continue;
+
+        if (objLink((Obj *)entry->key) != NULL) {
+            entry->key = (ObjString *)objLink((Obj *)entry->key);
+        } else {
+            entry->key = NULL;
+            entry->value = BOOL_VAL(true);  // Tombstone
+        }
+    }
+}
+
+// === Compaction ===
+//
+// With --gc-compact, a cycle that leaves the pages of small objects
+// fragmented is followed by a compaction at the next safepoint, right
+// after the nursery is emptied. The objects of the emptiest pages move to
+// free slots of the others, and every reference to them is forwarded the
+// way a nursery collection forwards young objects. Strings keep their
+// hash, so vm.strings only needs its keys replaced. The emptied pages go
+// back to the system.
+
+static void
+evacuateObject(Obj *object)
+{
+    moveObject(object);
+}
+
+// Completes any cycle under way in one go
+static void
+finishCycle()
+{
+    if (vm.gcPhase == GC_IDLE) return;
+
+    if (vm.gcPhase == GC_MARK) {
+        uint64_t start = clockMicros();
+        traceReferences();
+        finishMarking();
+        vm.stats.markTotal += clockMicros() - start;
+    }
+
+    while (heapSweepPage(&vm.heap)) continue;
+
+    endCycle();
+    vm.nextGC = pace();
+}
+
+static void
+compactHeap()
+{
+    beginPause();
+    vm.compactDue = false;
+    vm.stats.compactions++;
+    finishCycle();
+
+#ifdef DEBUG_LOG_GC
+    printf("--> Begin Compaction\n");
+#endif // DEBUG_LOG_GC
+
+    int pageCount = heapSelectEvacuation(&vm.heap);
+
+    if (pageCount > 0) {
+        evacuating = true;
+        heapEvacuate(&vm.heap, evacuateObject);
+
+        forwardRoots();
+        for (int i = 0; i < vm.rememberedCount; i++) {
+            FORWARD(vm.remembered[i]);
+        }
+        heapEachObject(&vm.heap, forwardFields);
+        forwardTable(&vm.strings);
+
+        evacuating = false;
+        heapFreeEvacuated(&vm.heap);
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("<-- End Compaction\n");
+    printf("    Freed %d pages\n", pageCount);
+#endif // DEBUG_LOG_GC
+
+    endPause();
+}
+
+void
+collectNursery()
+{
+#ifdef DEBUG_LOG_GC
+    printf("--> Begin Nursery Collection\n");
+    size_t before = vm.bytesAllocated;
+#endif // DEBUG_LOG_GC
+
+    beginPause();
+    vm.stats.nurseryCollections++;
+
+    // Entries below are gray objects of the old generation's marking
+    int grayBase = vm.grayCount;
+
+    forwardRoots();
+
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        setRemembered(vm.remembered[i], false);
+        forwardFields(vm.remembered[i]);
+    }
+    vm.rememberedCount = 0;
+
+    for (int i = grayBase; i < vm.grayCount; i++) {
+        forwardFields(vm.grayStack[i]);
+    }
+
+    // While marking, promoted objects stay gray for the marker to scan
+    if (vm.gcPhase != GC_MARK) vm.grayCount = grayBase;
+
+    forwardStrings();
+
+    for (Obj *object = (Obj *)vm.nursery;
+         (uint8_t *)object < vm.nurseryTop;
+         object = nextYoung(object)
+    ) {
+        if (objLink(object) == NULL) releaseObject(object);
+    }
+
+#ifdef DEBUG_STRESS_GC
+    // Makes any pointer left behind into the nursery fail fast
+    memset(vm.nursery, 0xdb, vm.nurseryTop - vm.nursery);
+#endif // DEBUG_STRESS_GC
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryFull = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("<-- End Nursery Collection\n");
+    printf("    Promoted %zu bytes : (from %zu to %zu)\n",
+           vm.bytesAllocated - before, before, vm.bytesAllocated);
+#endif // DEBUG_LOG_GC
+
+    // The old generation only grows here, and nothing holds a pointer
+    // into it, so a slice or a compaction may as well run now if one is
+    // due.
+    if (vm.bytesAllocated > vm.nextGC) collectStep();
+    if (vm.compactDue) compactHeap();
+
+    endPause();
+}
+
+#undef FORWARD
+
 void
 freeObjects()
 {
-    Obj *object = vm.objects;
-    while (object != NULL) {
-        Obj *next = object->next;
-        freeObject(object);
-        object = next;
+    for (Obj *object = (Obj *)vm.nursery;
+         (uint8_t *)object < vm.nurseryTop;
+         object = nextYoung(object)
+    ) {
+        // Tenured ones are freed through their copy
+        if (objLink(object) == NULL) releaseObject(object);
     }
 
+    freeHeap(&vm.heap);
+
+    stopMarkers();
     free(vm.grayStack);
+    free(vm.remembered);
+}
+
+// === Statistics ===
+
+int
+countInternedStrings()
+{
+    int count = 0;
+    for (int i = 0; i < vm.strings.capacity; i++) {
+        if (vm.strings.entries[i].key != NULL) count++;
+    }
+
+    return count;
+}
+
+void
+printGcStats()
+{
+    GcStats *stats = &vm.stats;
+
+    fprintf(stderr, "Collections       : %llu (%llu nursery, %llu compactions)\n",
+            (unsigned long long)stats->cycles,
+            (unsigned long long)stats->nurseryCollections,
+            (unsigned long long)stats->compactions);
+    fprintf(stderr, "Pauses            : %llu, %.3f ms total, %.3f ms max\n",
+            (unsigned long long)stats->pauses, stats->pauseTotal / 1000.0,
+            stats->pauseMax / 1000.0);
+    fprintf(stderr, "Marking           : %.3f ms\n", stats->markTotal / 1000.0);
+    fprintf(stderr, "Heap              : %zu bytes, %zu after the last cycle\n",
+            vm.bytesAllocated, stats->heapAfterGC);
+    fprintf(stderr, "Interned strings  : %d\n", countInternedStrings());
+
+    fprintf(stderr, "%-13s %12s %14s %12s %14s\n", "Type", "Allocated",
+            "Bytes", "Freed", "Bytes");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        fprintf(stderr, "%-13s %12llu %14llu %12llu %14llu\n",
+                objTypeName((ObjType)type),
+                (unsigned long long)stats->objectsAllocated[type],
+                (unsigned long long)stats->bytesAllocated[type],
+                (unsigned long long)stats->objectsFreed[type],
+                (unsigned long long)stats->bytesFreed[type]);
+    }
 }
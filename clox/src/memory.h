@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count)                                       \
     (type *)reallocate(NULL, 0, sizeof(type) * (count))
@@ -19,19 +20,130 @@
 #define FREE_ARRAY(type, pointer, oldCount)                         \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Short-lived objects start in a nursery of this many bytes, and move to
+// the old generation once they survive a nursery collection. Build with
+// EXTRA=-DNURSERY_SIZE=<bytes> to change it.
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (1024 * 1024)
+#endif // NURSERY_SIZE
+
+// Default budget for one slice of the old generation's collector, in
+// microseconds. Build with EXTRA=-DGC_PAUSE=<us> or run with --gc-pause to
+// change it; 0 collects the whole heap in one go.
+#ifndef GC_PAUSE
+#define GC_PAUSE 1000
+#endif // GC_PAUSE
+
+// Heap size that starts the first cycle, and how much the heap may grow
+// by after each one, in percent of what survived it. Both can be changed
+// at build time the same way, or with --gc-start and --gc-growth.
+#ifndef GC_START
+#define GC_START (1024 * 1024)
+#endif // GC_START
+
+#ifndef GC_GROWTH
+#define GC_GROWTH 100
+#endif // GC_GROWTH
+
+// Most threads --gc-threads may share marking between
+#ifndef GC_THREADS_MAX
+#define GC_THREADS_MAX 256
+#endif // GC_THREADS_MAX
+
 void *
 reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+Obj *
+allocateOld(size_t size);
+
+Obj *
+allocateYoung(size_t size);
+
+void
+rememberObject(Obj *object);
+
+Obj *
+tenureObject(Obj *object);
+
+void
+pushGray(Obj *object);
+
 void
 markObject(Obj *object);
 
 void
 markValue(Value value);
 
+size_t
+objectSize(Obj *object);
+
 void
-collectGarbage();
+releaseObject(Obj *object);
+
+void
+collectStep();
+
+void
+collectNursery();
 
 void
 freeObjects();
 
+int
+countInternedStrings();
+
+void
+printGcStats();
+
+static inline bool
+isYoung(Obj *object)
+{
+    return (uintptr_t)object - (uintptr_t)vm.nursery < NURSERY_SIZE;
+}
+
+// Young objects are never marked, they are all scanned when marking ends
+static inline bool
+isMarked(Obj *object)
+{
+    return !isYoung(object) && testMark(object);
+}
+
+// Must follow every store of a pointer into an object, except for globals
+// and the stack, which are roots anyway. An old object that comes to point
+// into the nursery is treated as a root by the next nursery collection.
+// While marking is under way, a marked object must not come to point to an
+// unmarked one.
+static inline void
+objectBarrier(Obj *object, Obj *target)
+{
+    if (isYoung(target)) {
+        if (!isRemembered(object) && !isYoung(object)) rememberObject(object);
+    } else if (vm.gcPhase == GC_MARK && isMarked(object)) {
+        markObject(target);
+    }
+}
+
+static inline void
+writeBarrier(Obj *object, Value value)
+{
+    if (IS_OBJ(value)) objectBarrier(object, AS_OBJ(value));
+}
+
+// For stores into places that are only scanned along with an object the
+// store cannot name, such as inline caches.
+static inline void
+shadeObject(Obj *target)
+{
+    if (vm.gcPhase == GC_MARK) markObject(target);
+}
+
+// Nursery collections move objects, so they only run at safepoints : places
+// where no C code holds a pointer to a young object. Those are calls,
+// returns and loop back-edges, in the interpreter and in compiled code.
+static inline void
+safepoint()
+{
+    if (vm.nurseryFull) collectNursery();
+}
+
 #endif // CLOX_MEMORY_H
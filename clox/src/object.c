@@ -1,24 +1,53 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType)                          \
-    (type *)allocateObject(sizeof(type), objectType)
+// Kinds of objects that tend to die young. The rest live about as long as
+// the program that defines them.
+static bool
+startsYoung(ObjType type)
+{
+    switch (type) {
+        case OBJ_BOUND_METHOD:
+        case OBJ_CLOSURE:
+        case OBJ_INSTANCE:
+        case OBJ_STRING:
+        case OBJ_UPVALUE:
+            return true;
+
+        default:
+            return false;
+    }
+}
 
-static Obj *
+Obj *
 allocateObject(size_t size, ObjType type)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    bool young = !vm.pretenure && startsYoung(type);
+
+    Obj *object = young ? allocateYoung(size) : NULL;
+    if (object == NULL) object = allocateOld(size);
 
-    object->type = type;
-    object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    initHeader(object, type);
+    vm.stats.objectsAllocated[type]++;
+    vm.stats.bytesAllocated[type] += size;
+
+    // Left out of a full nursery : its constructor stores young pointers
+    // without a write barrier
+    if (young && !isYoung(object)) rememberObject(object);
+
+    // The same goes for marked objects storing unmarked ones, so an old
+    // object created while marking starts out gray
+    if (vm.gcPhase == GC_MARK && !isYoung(object)) {
+        setMark(object);
+        pushGray(object);
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("%p : Allocate %zu : for %d\n", (void *)object, size, type);
@@ -27,22 +56,6 @@ allocateObject(size_t size, ObjType type)
     return object;
 }
 
-static ObjString *
-allocateString(char *chars, int length, uint32_t hash)
-{
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
-
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
-
-    return string;
-}
-
 static uint32_t
 hashString(const char *key, int length)
 {
@@ -56,6 +69,19 @@ hashString(const char *key, int length)
     return hash;
 }
 
+// Adds a new string to the interned set
+static ObjString *
+addString(ObjString *string, uint32_t hash)
+{
+    string->hash = hash;
+
+    push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+
+    return string;
+}
+
 ObjBoundMethod *
 newBoundMethod(Value receiver, ObjClosure *method)
 {
@@ -65,12 +91,42 @@ newBoundMethod(Value receiver, ObjClosure *method)
     return bound;
 }
 
+ObjChannel *
+newChannel(Channel *channel)
+{
+    ObjChannel *object = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    object->channel = channel;
+    return object;
+}
+
+static ObjShape *
+newShape(ObjClass *klass, ObjShape *parent, ObjString *name)
+{
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->klass = klass;
+    shape->parent = parent;
+    shape->name = name;
+    shape->slot = parent == NULL ? -1 : parent->fieldCount;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    return shape;
+}
+
 ObjClass *
 newClass(ObjString *name)
 {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->rootShape = NULL;
+    klass->shapeCount = 0;
+    klass->inlineFields = 0;
+
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(klass, NULL, NULL);
+    klass->shapeCount = 1;
+    pop();
+
     return klass;
 }
 
@@ -98,6 +154,11 @@ newFunction()
     function->name = NULL;
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 0;
+#ifdef JIT
+    function->hotness = JIT_THRESHOLD;
+#endif // JIT
+    function->jit = NULL;
     initChunk(&function->chunk);
 
     return function;
@@ -106,9 +167,16 @@ newFunction()
 ObjInstance *
 newInstance(ObjClass *klass)
 {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int inlineCount = klass->inlineFields;
+    ObjInstance *instance = (ObjInstance *)allocateObject(
+        sizeof(ObjInstance) + sizeof(Value) * inlineCount, OBJ_INSTANCE
+    );
+
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->as.spill = NULL;
+    instance->spillCapacity = 0;
+    instance->inlineCount = inlineCount;
     return instance;
 }
 
@@ -120,18 +188,148 @@ newNative(NativeFn function)
     return native;
 }
 
-ObjString *
-takeString(char *chars, int length)
+int
+shapeFindSlot(ObjShape *shape, ObjString *name)
 {
-    uint32_t hash = hashString(chars, length);
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->slot;
+    }
 
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    return -1;
+}
+
+static ObjShape *
+shapeTransition(ObjShape *shape, ObjString *name)
+{
+    Value child;
+    if (tableGet(&shape->transitions, name, &child)) {
+        return AS_SHAPE(child);
+    }
+
+    ObjClass *klass = shape->klass;
+    if (shape->fieldCount == SHAPE_MAX_FIELDS ||
+        klass->shapeCount == SHAPE_MAX_PER_CLASS) {
+        return NULL;
     }
 
-    return allocateString(chars, length, hash);
+    ObjShape *created = newShape(klass, shape, name);
+    push(OBJ_VAL(created));
+    tableSet(&shape->transitions, name, OBJ_VAL(created));
+    objectBarrier((Obj *)shape, (Obj *)name);
+    pop();
+
+    klass->shapeCount++;
+    return created;
+}
+
+static void
+makeDictionary(ObjInstance *instance)
+{
+    Table *dictionary = ALLOCATE(Table, 1);
+    initTable(dictionary);
+
+    // The instance keeps its shape until the copy is done so every key and
+    // value stays reachable if the table growth triggers a collection.
+    for (ObjShape *shape = instance->shape;
+         shape->parent != NULL;
+         shape = shape->parent
+    ) {
+        tableSet(dictionary, shape->name, *instanceSlot(instance, shape->slot));
+    }
+
+    FREE_ARRAY(Value, instance->as.spill, instance->spillCapacity);
+    instance->shape = NULL;
+    instance->as.dictionary = dictionary;
+    instance->spillCapacity = 0;
+}
+
+bool
+instanceGetField(ObjInstance *instance, ObjString *name, Value *value)
+{
+    if (instance->shape == NULL) {
+        return tableGet(instance->as.dictionary, name, value);
+    }
+
+    int slot = shapeFindSlot(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = *instanceSlot(instance, slot);
+    return true;
+}
+
+void
+instanceAddField(ObjInstance *instance, ObjShape *shape, Value value)
+{
+    int spillIndex = shape->slot - instance->inlineCount;
+    if (spillIndex >= instance->spillCapacity) {
+        int oldCap = instance->spillCapacity;
+        int capacity = GROW_CAPACITY(oldCap);
+        instance->as.spill = GROW_ARRAY(Value, instance->as.spill,
+                                        oldCap, capacity);
+        instance->spillCapacity = capacity;
+    }
+
+    *instanceSlot(instance, shape->slot) = value;
+    writeBarrier((Obj *)instance, value);
+    instance->shape = shape;
+
+    // Give later instances of the class enough inline room for this layout
+    ObjClass *klass = instance->klass;
+    if (shape->fieldCount > klass->inlineFields) {
+        klass->inlineFields = shape->fieldCount;
+    }
+}
+
+void
+instanceSetField(ObjInstance *instance, ObjString *name, Value value)
+{
+    if (instance->shape != NULL) {
+        int slot = shapeFindSlot(instance->shape, name);
+        if (slot != -1) {
+            *instanceSlot(instance, slot) = value;
+            writeBarrier((Obj *)instance, value);
+            return;
+        }
+
+        ObjShape *shape = shapeTransition(instance->shape, name);
+        if (shape != NULL) {
+            instanceAddField(instance, shape, value);
+            return;
+        }
+
+        makeDictionary(instance);
+    }
+
+    tableSet(instance->as.dictionary, name, value);
+    objectBarrier((Obj *)instance, (Obj *)name);
+    writeBarrier((Obj *)instance, value);
+}
+
+ObjString *
+newString(int length)
+{
+    ObjString *string = (ObjString *)allocateObject(
+        sizeof(ObjString) + length + 1, OBJ_STRING
+    );
+
+    string->length = length;
+    string->hash = 0;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// An interned copy wins over a new string, which is then left for the
+// collector.
+ObjString *
+internString(ObjString *string)
+{
+    uint32_t hash = hashString(string->chars, string->length);
+
+    ObjString *interned = tableFindString(&vm.strings, string->chars,
+                                          string->length, hash);
+    if (interned != NULL) return interned;
+
+    return addString(string, hash);
 }
 
 ObjString *
@@ -142,11 +340,9 @@ copyString(const char *chars, int length)
     ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL) return interned;
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-
-    return allocateString(heapChars, length, hash);
+    ObjString *string = newString(length);
+    memcpy(string->chars, chars, length);
+    return addString(string, hash);
 }
 
 ObjUpvalue *
@@ -170,6 +366,25 @@ printFunction(ObjFunction *function)
     printf("<Fn %s>", function->name->chars);
 }
 
+static const char *typeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_BOUND_METHOD] = "bound method",
+    [OBJ_CHANNEL]      = "channel",
+    [OBJ_CLASS]        = "class",
+    [OBJ_CLOSURE]      = "closure",
+    [OBJ_FUNCTION]     = "function",
+    [OBJ_INSTANCE]     = "instance",
+    [OBJ_NATIVE]       = "native",
+    [OBJ_SHAPE]        = "shape",
+    [OBJ_STRING]       = "string",
+    [OBJ_UPVALUE]      = "upvalue",
+};
+
+const char *
+objTypeName(ObjType type)
+{
+    return typeNames[type];
+}
+
 void
 printObject(Value value)
 {
@@ -178,6 +393,10 @@ printObject(Value value)
             printFunction(AS_BOUND_METHOD(value)->method->function);
         } break;
 
+        case OBJ_CHANNEL: {
+            printf("<Channel>");
+        } break;
+
         case OBJ_CLASS: {
             printf("%s", AS_CLASS(value)->name->chars);
         } break;
@@ -198,6 +417,10 @@ printObject(Value value)
             printf("<Native Fn>");
         } break;
 
+        case OBJ_SHAPE: {
+            printf("shape");
+        } break;
+
         case OBJ_STRING: {
             printf("%s", AS_CSTRING(value));
         } break;
@@ -6,47 +6,103 @@
 #include "table.h"
 #include "value.h"
 
-#define OBJ_TYPE(value)         (AS_OBJ(value)->type)
+#define OBJ_TYPE(value)         objType(AS_OBJ(value))
 
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CHANNEL(value)       isObjType(value, OBJ_CHANNEL)
 #define IS_CLASS(value)         isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)       isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value)         isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_CHANNEL(value)       (((ObjChannel *)AS_OBJ(value))->channel)
 #define AS_CLASS(value)         ((ObjClass *)AS_OBJ(value))
 #define AS_CLOSURE(value)       ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value)      ((ObjFunction *)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance *)AS_OBJ(value))
 #define AS_NATIVE(value)        (((ObjNative *)AS_OBJ(value))->function)
+#define AS_SHAPE(value)         ((ObjShape *)AS_OBJ(value))
 #define AS_STRING(value)        ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString *)AS_OBJ(value))->chars)
 
 typedef enum {
     OBJ_BOUND_METHOD,   // GC Type : 0
-    OBJ_CLASS,          // GC Type : 1
-    OBJ_CLOSURE,        // GC Type : 2
-    OBJ_FUNCTION,       // GC Type : 3
-    OBJ_INSTANCE,       // GC Type : 4
-    OBJ_NATIVE,         // GC Type : 5
-    OBJ_STRING,         // GC Type : 6
-    OBJ_UPVALUE         // GC Type : 7
+    OBJ_CHANNEL,        // GC Type : 1
+    OBJ_CLASS,          // GC Type : 2
+    OBJ_CLOSURE,        // GC Type : 3
+    OBJ_FUNCTION,       // GC Type : 4
+    OBJ_INSTANCE,       // GC Type : 5
+    OBJ_NATIVE,         // GC Type : 6
+    OBJ_SHAPE,          // GC Type : 7
+    OBJ_STRING,         // GC Type : 8
+    OBJ_UPVALUE         // GC Type : 9
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+// The header of every object is a single word, read and written through
+// the accessors below. Its low 48 bits, enough for any user-space address
+// on x86-64 and AArch64, hold a link : a young object that a nursery
+// collection has copied out points to its copy, and the link is NULL
+// otherwise. Bit 48 is set on old objects listed in vm.remembered, and the
+// top byte holds the type.
 struct Obj {
-    ObjType type;
-    bool isMarked;
-    struct Obj *next;
+    uint64_t header;
 };
 
+#define HEADER_LINK_MASK    (((uint64_t)1 << 48) - 1)
+#define HEADER_REMEMBERED   ((uint64_t)1 << 48)
+#define HEADER_TYPE_SHIFT   56
+
+static inline void
+initHeader(Obj *object, ObjType type)
+{
+    object->header = (uint64_t)type << HEADER_TYPE_SHIFT;
+}
+
+static inline ObjType
+objType(Obj *object)
+{
+    return (ObjType)(object->header >> HEADER_TYPE_SHIFT);
+}
+
+static inline Obj *
+objLink(Obj *object)
+{
+    return (Obj *)(uintptr_t)(object->header & HEADER_LINK_MASK);
+}
+
+static inline void
+setObjLink(Obj *object, Obj *link)
+{
+    object->header = (object->header & ~HEADER_LINK_MASK) | (uintptr_t)link;
+}
+
+static inline bool
+isRemembered(Obj *object)
+{
+    return (object->header & HEADER_REMEMBERED) != 0;
+}
+
+static inline void
+setRemembered(Obj *object, bool remembered)
+{
+    if (remembered) {
+        object->header |= HEADER_REMEMBERED;
+    } else {
+        object->header &= ~HEADER_REMEMBERED;
+    }
+}
+
 struct ObjString {
     Obj obj;
-    char *chars;
     int length;
     uint32_t hash;
+    char chars[];
 };
 
 typedef struct ObjUpvalue {
@@ -56,31 +112,66 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue *next;
 } ObjUpvalue;
 
+typedef struct JitCode JitCode;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxSlots;       // Most stack slots it uses at once, temporaries included
     Chunk chunk;
     ObjString *name;
+
+    int hotness;        // Calls and back-edges left before it is compiled
+    JitCode *jit;       // Machine code, once hot
 } ObjFunction;
 
-typedef struct {
+struct ObjClosure {
     Obj obj;
     ObjFunction *function;
     ObjUpvalue **upvalues;
     int upvalueCount;
-} ObjClosure;
+};
 
-typedef struct {
+// Past these limits an instance stops following its class's shape tree and
+// keeps its fields in a hash table instead.
+#define SHAPE_MAX_FIELDS    64
+#define SHAPE_MAX_PER_CLASS 256
+
+struct ObjClass {
     Obj obj;
     ObjString *name;
     Table methods;
-} ObjClass;
+
+    ObjShape *rootShape;
+    int shapeCount;
+    int inlineFields;   // Inline slots given to new instances
+};
+
+// A shape describes the field layout shared by every instance that added
+// the same fields in the same order. Shapes form a tree per class : each
+// child adds one field, stored in the next slot.
+struct ObjShape {
+    Obj obj;
+    ObjClass *klass;
+    ObjShape *parent;
+    ObjString *name;
+    int slot;
+    int fieldCount;
+    Table transitions;
+};
 
 typedef struct {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+    ObjShape *shape;    // NULL once the instance is in dictionary mode
+    union {
+        Value *spill;       // Slots past the inline ones
+        Table *dictionary;
+    } as;
+    int spillCapacity;
+    int inlineCount;
+    Value fields[];
 } ObjInstance;
 
 typedef struct {
@@ -96,9 +187,30 @@ typedef struct {
     NativeFn function;
 } ObjNative;
 
+typedef struct Channel Channel;
+
+// One VM's reference to a channel, which every VM holding one shares
+typedef struct {
+    Obj obj;
+    Channel *channel;
+} ObjChannel;
+
+#define ALLOCATE_OBJ(type, objectType)                          \
+    (type *)allocateObject(sizeof(type), objectType)
+
+// Only sets the header : the caller fills in the rest before anything can
+// collect the object
+Obj *
+allocateObject(size_t size, ObjType type);
+
 ObjBoundMethod *
 newBoundMethod(Value receiver, ObjClosure *method);
 
+// Takes over a reference to the channel, which the object releases when
+// it is freed
+ObjChannel *
+newChannel(Channel *channel);
+
 ObjClass *
 newClass(ObjString *name);
 
@@ -114,8 +226,25 @@ newInstance(ObjClass *klass);
 ObjNative *
 newNative(NativeFn function);
 
+int
+shapeFindSlot(ObjShape *shape, ObjString *name);
+
+bool
+instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
+
+void
+instanceSetField(ObjInstance *instance, ObjString *name, Value value);
+
+void
+instanceAddField(ObjInstance *instance, ObjShape *shape, Value value);
+
+// Allocates a string for the caller to fill in, then hands it to
+// internString(), which may return an existing copy in its place.
 ObjString *
-takeString(char *chars, int length);
+newString(int length);
+
+ObjString *
+internString(ObjString *string);
 
 ObjString *
 copyString(const char *chars, int length);
@@ -123,13 +252,23 @@ copyString(const char *chars, int length);
 ObjUpvalue *
 newUpvalue(Value *slot);
 
+const char *
+objTypeName(ObjType type);
+
 void
 printObject(Value value);
 
 static inline bool
 isObjType(Value value, ObjType type)
 {
-    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+    return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
+}
+
+static inline Value *
+instanceSlot(ObjInstance *instance, int slot)
+{
+    if (slot < instance->inlineCount) return &instance->fields[slot];
+    return &instance->as.spill[slot - instance->inlineCount];
 }
 
 #endif // CLOX_OBJECT_H
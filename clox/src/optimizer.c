@@ -0,0 +1,592 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "optimizer.h"
+
+// Longest run of instructions the sequence report counts
+#define SEQUENCE_MAX 4
+
+typedef struct {
+    uint64_t key;       // Opcodes plus one, a byte each. Zero when empty
+    int length;
+    long count;
+} Sequence;
+
+// Counts the chunks optimized on the thread that began the report
+static _Thread_local struct {
+    bool enabled;
+    Sequence *entries;
+    int count;
+    int capacity;
+
+    long instructionsIn;
+    long instructionsOut;
+} report;
+
+typedef struct {
+    uint8_t *code;
+    int *lines;
+    int *jumps;         // Original target of the jump emitted at an offset
+    int count;
+    int line;
+} Output;
+
+static const uint8_t lessJumpSequence[] = {
+    OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP
+};
+static const uint8_t addLocalsSequence[] = {
+    OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD
+};
+static const uint8_t addConstantSequence[] = {
+    OP_GET_LOCAL, OP_CONSTANT, OP_ADD
+};
+static const uint8_t subtractConstantSequence[] = {
+    OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT
+};
+static const uint8_t localPropertySequence[] = {
+    OP_GET_LOCAL, OP_GET_PROPERTY
+};
+
+static bool
+isJump(uint8_t instruction)
+{
+    return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+           instruction == OP_LOOP;
+}
+
+// The opcode at offset. Forward jumps come out of the compiler wide, so a
+// wide jump reads as the jump itself.
+static uint8_t
+opcodeAt(Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    if (code[0] == OP_WIDE && isJump(code[1])) return code[1];
+    return code[0];
+}
+
+static int
+jumpDistance(Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    if (code[0] == OP_WIDE) {
+        return (int)((uint32_t)code[2] << 24 | code[3] << 16 | code[4] << 8 | code[5]);
+    }
+
+    return code[1] << 8 | code[2];
+}
+
+static int
+jumpTarget(Chunk *chunk, int offset)
+{
+    int end = offset + instructionLength(chunk, offset);
+    int jump = jumpDistance(chunk, offset);
+
+    if (opcodeAt(chunk, offset) == OP_LOOP) return end - jump;
+    return end + jump;
+}
+
+// Marks every offset a jump can land on. No fused sequence may contain one
+// past its first instruction.
+static bool *
+findJumpTargets(Chunk *chunk)
+{
+    bool *targets = ALLOCATE(bool, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) targets[i] = false;
+
+    for (int offset = 0; offset < chunk->count;) {
+        if (isJump(opcodeAt(chunk, offset))) {
+            int target = jumpTarget(chunk, offset);
+            targets[target] = true;
+
+            // A fused conditional jump lands just past the POP it skips
+            if (opcodeAt(chunk, offset) == OP_JUMP_IF_FALSE &&
+                target < chunk->count && chunk->code[target] == OP_POP) {
+                targets[target + 1] = true;
+            }
+        }
+
+        offset += instructionLength(chunk, offset);
+    }
+
+    return targets;
+}
+
+static bool
+matchSequence(Chunk *chunk, bool *targets, int offset,
+              const uint8_t *sequence, int length, int *starts)
+{
+    for (int i = 0; i < length; i++) {
+        if (offset >= chunk->count) return false;
+        if (i > 0 && targets[offset]) return false;
+        if (opcodeAt(chunk, offset) != sequence[i]) return false;
+
+        starts[i] = offset;
+        offset += instructionLength(chunk, offset);
+    }
+
+    return true;
+}
+
+static void
+emitByte(Output *out, uint8_t byte)
+{
+    out->code[out->count] = byte;
+    out->lines[out->count] = out->line;
+    out->count++;
+}
+
+static void
+emitJump(Output *out, uint8_t instruction, int target)
+{
+    out->jumps[out->count] = target;
+    emitByte(out, instruction);
+}
+
+// Emits the superinstruction for the sequence starting at offset and
+// returns the offset just past it, or -1 when nothing matches.
+static int
+fuse(Chunk *chunk, bool *targets, int offset, Output *out)
+{
+    uint8_t *code = chunk->code;
+    int at[5];
+
+#define MATCH(sequence)                                                 \
+    matchSequence(chunk, targets, offset, sequence,                     \
+                  (int)sizeof(sequence), at)
+#define SINGLE_AFTER(instruction)                                       \
+    (offset + 1 < chunk->count && !targets[offset + 1] &&               \
+     code[offset + 1] == (instruction))
+
+    switch (code[offset]) {
+        case OP_GET_LOCAL: {
+            if (MATCH(lessJumpSequence) &&
+                jumpDistance(chunk, at[3]) <= UINT16_MAX) {
+                int exit = jumpTarget(chunk, at[3]);
+
+                // The condition is never pushed, so the false edge skips
+                // the POP at its target as well.
+                if (exit < chunk->count && code[exit] == OP_POP) {
+                    emitJump(out, OP_LESS_LOCAL_CONST_JUMP, exit + 1);
+                    emitByte(out, code[at[0] + 1]);
+                    emitByte(out, code[at[1] + 1]);
+                    emitByte(out, 0xff);
+                    emitByte(out, 0xff);
+                    return at[4] + 1;
+                }
+            }
+
+            if (MATCH(addLocalsSequence)) {
+                emitByte(out, OP_ADD_LOCAL_LOCAL);
+                emitByte(out, code[at[0] + 1]);
+                emitByte(out, code[at[1] + 1]);
+                return at[2] + 1;
+            }
+
+            if (MATCH(addConstantSequence)) {
+                emitByte(out, OP_ADD_LOCAL_CONST);
+                emitByte(out, code[at[0] + 1]);
+                emitByte(out, code[at[1] + 1]);
+                return at[2] + 1;
+            }
+
+            if (MATCH(subtractConstantSequence)) {
+                emitByte(out, OP_SUBTRACT_LOCAL_CONST);
+                emitByte(out, code[at[0] + 1]);
+                emitByte(out, code[at[1] + 1]);
+                return at[2] + 1;
+            }
+
+            if (MATCH(localPropertySequence)) {
+                emitByte(out, OP_GET_LOCAL_PROPERTY);
+                emitByte(out, code[at[0] + 1]);
+                emitByte(out, code[at[1] + 1]);
+                emitByte(out, code[at[1] + 2]);
+                emitByte(out, code[at[1] + 3]);
+                return at[1] + 4;
+            }
+        } break;
+
+        case OP_SET_LOCAL: {
+            if (offset + 2 < chunk->count && !targets[offset + 2] &&
+                code[offset + 2] == OP_POP) {
+                emitByte(out, OP_SET_LOCAL_POP);
+                emitByte(out, code[offset + 1]);
+                return offset + 3;
+            }
+        } break;
+
+        case OP_EQUAL: {
+            if (SINGLE_AFTER(OP_NOT)) {
+                emitByte(out, OP_NOT_EQUAL);
+                return offset + 2;
+            }
+        } break;
+
+        case OP_GREATER: {
+            if (SINGLE_AFTER(OP_NOT)) {
+                emitByte(out, OP_NOT_GREATER);
+                return offset + 2;
+            }
+        } break;
+
+        case OP_LESS: {
+            if (SINGLE_AFTER(OP_NOT)) {
+                emitByte(out, OP_NOT_LESS);
+                return offset + 2;
+            }
+        } break;
+
+        default: break;
+    }
+
+#undef MATCH
+#undef SINGLE_AFTER
+
+    return -1;
+}
+
+static void
+patchJumps(Chunk *chunk, int *jumps, int *offsets)
+{
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t instruction = opcodeAt(chunk, offset);
+        int length = instructionLength(chunk, offset);
+
+        if (isJump(instruction) || instruction == OP_LESS_LOCAL_CONST_JUMP) {
+            int target = offsets[jumps[offset]];
+            int jump = instruction == OP_LOOP ? offset + length - target
+                                              : target - (offset + length);
+
+            uint8_t *end = &chunk->code[offset + length];
+            if (chunk->code[offset] == OP_WIDE) {
+                end[-4] = (jump >> 24) & 0xff;
+                end[-3] = (jump >> 16) & 0xff;
+            }
+            end[-2] = (jump >> 8) & 0xff;
+            end[-1] = jump & 0xff;
+        }
+
+        offset += length;
+    }
+}
+
+static uint32_t
+hashSequence(uint64_t key)
+{
+    key ^= key >> 29;
+    key *= 0x9e3779b97f4a7c15u;
+    return (uint32_t)(key >> 32);
+}
+
+static void
+recordSequence(uint64_t key, int length)
+{
+    if (report.count + 1 > report.capacity * 3 / 4) {
+        int oldCap = report.capacity;
+        Sequence *oldEntries = report.entries;
+
+        report.capacity = oldCap < 256 ? 256 : oldCap * 2;
+        report.entries = calloc(report.capacity, sizeof(Sequence));
+        if (report.entries == NULL) exit(1);
+
+        for (int i = 0; i < oldCap; i++) {
+            Sequence *entry = &oldEntries[i];
+            if (entry->key == 0) continue;
+
+            uint32_t index = hashSequence(entry->key) & (report.capacity - 1);
+            while (report.entries[index].key != 0) {
+                index = (index + 1) & (report.capacity - 1);
+            }
+            report.entries[index] = *entry;
+        }
+
+        free(oldEntries);
+    }
+
+    uint32_t index = hashSequence(key) & (report.capacity - 1);
+    for (;;) {
+        Sequence *entry = &report.entries[index];
+        if (entry->key == key) {
+            entry->count++;
+            return;
+        }
+
+        if (entry->key == 0) {
+            entry->key = key;
+            entry->length = length;
+            entry->count = 1;
+            report.count++;
+            return;
+        }
+
+        index = (index + 1) & (report.capacity - 1);
+    }
+}
+
+static void
+countSequences(Chunk *chunk, bool *targets)
+{
+    for (int offset = 0; offset < chunk->count;) {
+        uint64_t key = 0;
+        int next = offset;
+
+        for (int length = 1; length <= SEQUENCE_MAX; length++) {
+            if (next >= chunk->count || (length > 1 && targets[next])) break;
+
+            key = key << 8 | (uint64_t)(opcodeAt(chunk, next) + 1);
+            next += instructionLength(chunk, next);
+            if (length > 1) recordSequence(key, length);
+        }
+
+        report.instructionsIn++;
+        offset += instructionLength(chunk, offset);
+    }
+}
+
+static int
+compareSequences(const void *a, const void *b)
+{
+    const Sequence *left = a;
+    const Sequence *right = b;
+
+    if (left->count != right->count) return left->count < right->count ? 1 : -1;
+    if (left->length != right->length) return left->length - right->length;
+    return left->key < right->key ? -1 : left->key > right->key;
+}
+
+void
+beginSequenceReport()
+{
+    report.enabled = true;
+    report.entries = NULL;
+    report.count = 0;
+    report.capacity = 0;
+    report.instructionsIn = 0;
+    report.instructionsOut = 0;
+}
+
+void
+printSequenceReport(int limit)
+{
+    int used = 0;
+    for (int i = 0; i < report.capacity; i++) {
+        if (report.entries[i].key != 0) report.entries[used++] = report.entries[i];
+    }
+    if (used > 0) qsort(report.entries, used, sizeof(Sequence), compareSequences);
+
+    printf("Instructions: %ld before fusion, %ld after\n",
+           report.instructionsIn, report.instructionsOut);
+
+    for (int i = 0; i < used && i < limit; i++) {
+        Sequence *entry = &report.entries[i];
+        printf("%8ld ", entry->count);
+
+        for (int j = entry->length - 1; j >= 0; j--) {
+            uint8_t opcode = (uint8_t)((entry->key >> (j * 8)) & 0xff) - 1;
+            printf(" %s", opcodeName(opcode));
+        }
+        printf("\n");
+    }
+
+    free(report.entries);
+    report.entries = NULL;
+    report.enabled = false;
+}
+
+void
+optimizeChunk(Chunk *chunk)
+{
+    if (chunk->count == 0) return;
+
+    bool *targets = findJumpTargets(chunk);
+    if (report.enabled) countSequences(chunk, targets);
+
+    Output out;
+    out.code = ALLOCATE(uint8_t, chunk->capacity);
+    out.lines = ALLOCATE(int, chunk->capacity);
+    out.jumps = ALLOCATE(int, chunk->count);
+    out.count = 0;
+
+    // Old instruction offset to new one, for every instruction that starts
+    // a sequence. Jump targets always do.
+    int *offsets = ALLOCATE(int, chunk->count + 1);
+
+    for (int offset = 0; offset < chunk->count;) {
+        offsets[offset] = out.count;
+        out.line = chunk->lines[offset];
+        if (report.enabled) report.instructionsOut++;
+
+        int next = fuse(chunk, targets, offset, &out);
+        if (next != -1) {
+            offset = next;
+            continue;
+        }
+
+        uint8_t instruction = opcodeAt(chunk, offset);
+        int length = instructionLength(chunk, offset);
+
+        // Code only shrinks, so a jump that fitted 16 bits before still
+        // does. The rest stay wide.
+        if (isJump(instruction) && jumpDistance(chunk, offset) > UINT16_MAX) {
+            emitJump(&out, OP_WIDE, jumpTarget(chunk, offset));
+            emitByte(&out, instruction);
+            for (int i = 0; i < 4; i++) emitByte(&out, 0xff);
+        } else if (isJump(instruction)) {
+            emitJump(&out, instruction, jumpTarget(chunk, offset));
+            emitByte(&out, 0xff);
+            emitByte(&out, 0xff);
+        } else {
+            for (int i = 0; i < length; i++) {
+                emitByte(&out, chunk->code[offset + i]);
+            }
+        }
+
+        offset += length;
+    }
+    offsets[chunk->count] = out.count;
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    chunk->code = out.code;
+    chunk->lines = out.lines;
+    int oldCount = chunk->count;
+    chunk->count = out.count;
+
+    patchJumps(chunk, out.jumps, offsets);
+
+    FREE_ARRAY(int, offsets, oldCount + 1);
+    FREE_ARRAY(int, out.jumps, oldCount);
+    FREE_ARRAY(bool, targets, oldCount + 1);
+}
+
+// Returns how an instruction changes the depth of the stack, and sets peak
+// to the most slots it holds above the depth it started from.
+static int
+stackEffect(Chunk *chunk, int offset, int *peak)
+{
+    uint8_t *code = &chunk->code[offset];
+    bool wide = code[0] == OP_WIDE;
+    uint8_t instruction = wide ? code[1] : code[0];
+    *peak = 0;
+
+    switch ((OpCode)instruction) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_SUBTRACT_LOCAL_CONST:
+        case OP_GET_LOCAL_PROPERTY:
+            *peak = 1;
+            return 1;
+
+        // Both operands go on the stack when they are not two numbers
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONST:
+            *peak = 2;
+            return 1;
+
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_LESS_LOCAL_CONST_JUMP:
+        case OP_WIDE:
+            return 0;
+
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_EQUAL_NUM_NUM:
+        case OP_GREATER_NUM_NUM:
+        case OP_LESS_NUM_NUM:
+        case OP_ADD_NUM_NUM:
+        case OP_ADD_STR_STR:
+        case OP_SUBTRACT_NUM_NUM:
+        case OP_MULTIPLY_NUM_NUM:
+        case OP_DIVIDE_NUM_NUM:
+        case OP_NOT_EQUAL:
+        case OP_NOT_GREATER:
+        case OP_NOT_LESS:
+        case OP_SET_LOCAL_POP:
+            return -1;
+
+        // The callee and its arguments give way to the result
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -code[1];
+
+        case OP_INVOKE:
+            return -(wide ? code[4] : code[2]);
+
+        // The superclass goes as well
+        case OP_SUPER_INVOKE:
+            return -(wide ? code[4] : code[2]) - 1;
+    }
+
+    return 0; // Unreachable
+}
+
+int
+maxStackDepth(Chunk *chunk, int entry)
+{
+    // Deepest stack seen on any jump to each offset. Jumps back only go to
+    // code that has been reached already, with the same depth.
+    int *depths = ALLOCATE(int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) depths[i] = 0;
+
+    int depth = entry;
+    int max = entry;
+
+    for (int offset = 0; offset < chunk->count;) {
+        // Code right after a return or a jump is only reached through
+        // jumps to it, and the deepest of them wins
+        if (depths[offset] > depth) depth = depths[offset];
+
+        int peak;
+        int effect = stackEffect(chunk, offset, &peak);
+        if (depth + peak > max) max = depth + peak;
+        depth += effect;
+
+        uint8_t instruction = opcodeAt(chunk, offset);
+        int length = instructionLength(chunk, offset);
+        int target = -1;
+
+        if (instruction == OP_LESS_LOCAL_CONST_JUMP) {
+            uint8_t *code = &chunk->code[offset];
+            target = offset + length + (code[3] << 8 | code[4]);
+        } else if (isJump(instruction) && instruction != OP_LOOP) {
+            target = jumpTarget(chunk, offset);
+        }
+
+        if (target != -1 && depths[target] < depth) depths[target] = depth;
+        offset += length;
+    }
+
+    FREE_ARRAY(int, depths, chunk->count + 1);
+    return max;
+}
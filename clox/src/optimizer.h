@@ -0,0 +1,26 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+
+// Rewrites common instruction sequences of a finished chunk into
+// superinstructions and gives every jump that fits its 16-bit form, fixing
+// up jump offsets and line numbers.
+void
+optimizeChunk(Chunk *chunk);
+
+// Most stack slots the chunk's code holds at once, locals and temporaries
+// alike, in a frame that starts out with entry slots : the callee and its
+// arguments.
+int
+maxStackDepth(Chunk *chunk, int entry);
+
+// Sequence report : while enabled, every chunk handed to optimizeChunk()
+// has its instruction sequences counted before they are fused.
+void
+beginSequenceReport();
+
+void
+printSequenceReport(int limit);
+
+#endif // CLOX_OPTIMIZER_H
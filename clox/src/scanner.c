@@ -4,7 +4,7 @@
 #include "common.h"
 #include "scanner.h"
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 static bool
 isAtEnd()
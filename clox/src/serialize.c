@@ -0,0 +1,246 @@
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "serialize.h"
+
+#define OPCODE_COUNT (OP_LESS_LOCAL_CONST_JUMP + 1)
+
+// Where the checksum sits, and the part of the file it covers
+#define CHECKSUM_OFFSET 12
+#define HEADER_SIZE     (CHECKSUM_OFFSET + 8)
+
+uint64_t
+hashBytes(const void *bytes, size_t length)
+{
+    const uint8_t *data = (const uint8_t *)bytes;
+    uint64_t hash = 14695981039346656037u;
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash ^= word;
+        hash *= 1099511628211u;
+    }
+
+    for (; i < length; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+void
+beginFile(Buffer *buffer, const char *magic, int version)
+{
+    buffer->data = NULL;
+    buffer->count = 0;
+    buffer->capacity = 0;
+
+    writeBytes(buffer, magic, 4);
+    writeInt(buffer, version);
+    writeInt(buffer, OPCODE_COUNT);
+    writeLong(buffer, 0);
+}
+
+bool
+writeFile(Buffer *buffer, const char *path)
+{
+    uint64_t checksum = hashBytes(buffer->data + HEADER_SIZE,
+                                  buffer->count - HEADER_SIZE);
+    memcpy(buffer->data + CHECKSUM_OFFSET, &checksum, sizeof(checksum));
+
+    bool ok = false;
+    char temporary[4096];
+    int written = snprintf(temporary, sizeof(temporary), "%s.%ld", path,
+                           (long)getpid());
+
+    FILE *file = NULL;
+    if (written > 0 && (size_t)written < sizeof(temporary)) {
+        file = fopen(temporary, "wb");
+    }
+
+    if (file != NULL) {
+        ok = fwrite(buffer->data, 1, buffer->count, file) == buffer->count;
+        ok = fclose(file) == 0 && ok;
+        ok = ok && rename(temporary, path) == 0;
+        if (!ok) remove(temporary);
+    }
+
+    free(buffer->data);
+    buffer->data = NULL;
+    return ok;
+}
+
+void
+writeBytes(Buffer *buffer, const void *bytes, size_t count)
+{
+    if (buffer->capacity < buffer->count + count) {
+        size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+        while (capacity < buffer->count + count) capacity *= 2;
+
+        buffer->data = (uint8_t *)realloc(buffer->data, capacity);
+        if (buffer->data == NULL) exit(1);
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+void
+writeInt(Buffer *buffer, int32_t value)
+{
+    writeBytes(buffer, &value, sizeof(value));
+}
+
+void
+writeLong(Buffer *buffer, uint64_t value)
+{
+    writeBytes(buffer, &value, sizeof(value));
+}
+
+void
+writeString(Buffer *buffer, ObjString *string)
+{
+    writeInt(buffer, string->length);
+    writeBytes(buffer, string->chars, string->length);
+}
+
+void
+writeCode(Buffer *buffer, Chunk *chunk)
+{
+    writeInt(buffer, chunk->count);
+    writeBytes(buffer, chunk->code, chunk->count);
+    writeBytes(buffer, chunk->lines, sizeof(int) * chunk->count);
+    writeInt(buffer, chunk->cacheCount);
+}
+
+bool
+mapFile(Reader *reader, const char *path, const char *magic, int version)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)status.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    reader->start = (const uint8_t *)mapping;
+    reader->current = reader->start;
+    reader->end = reader->start + size;
+    reader->failed = false;
+
+    const uint8_t *header = readBytes(reader, 4);
+    uint64_t checksum = hashBytes(reader->start + HEADER_SIZE,
+                                  size - HEADER_SIZE);
+    if (memcmp(header, magic, 4) == 0 &&
+        readInt(reader) == version &&
+        readInt(reader) == OPCODE_COUNT &&
+        readLong(reader) == checksum) {
+        return true;
+    }
+
+    unmapFile(reader);
+    return false;
+}
+
+void
+unmapFile(Reader *reader)
+{
+    munmap((void *)reader->start, reader->end - reader->start);
+}
+
+const uint8_t *
+readBytes(Reader *reader, size_t count)
+{
+    if (reader->failed || (size_t)(reader->end - reader->current) < count) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const uint8_t *bytes = reader->current;
+    reader->current += count;
+    return bytes;
+}
+
+int32_t
+readInt(Reader *reader)
+{
+    int32_t value = 0;
+    const uint8_t *bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+uint64_t
+readLong(Reader *reader)
+{
+    uint64_t value = 0;
+    const uint8_t *bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+ObjString *
+readString(Reader *reader)
+{
+    int32_t length = readCount(reader, 1);
+
+    const uint8_t *chars = readBytes(reader, length);
+    if (chars == NULL) return NULL;
+    return copyString((const char *)chars, length);
+}
+
+int32_t
+readCount(Reader *reader, size_t elementSize)
+{
+    int32_t count = readInt(reader);
+    if (count < 0 ||
+        (size_t)count > (size_t)(reader->end - reader->current) / elementSize) {
+        reader->failed = true;
+        return 0;
+    }
+
+    return count;
+}
+
+bool
+readCode(Reader *reader, Chunk *chunk)
+{
+    int32_t count = readCount(reader, 1 + sizeof(int));
+    const uint8_t *code = readBytes(reader, count);
+    const uint8_t *lines = readBytes(reader, sizeof(int) * count);
+    int32_t cacheCount = readInt(reader);
+    if (cacheCount < 0 || cacheCount > count) reader->failed = true;
+    if (reader->failed || chunk == NULL) return !reader->failed;
+
+    chunk->code = ALLOCATE(uint8_t, count);
+    memcpy(chunk->code, code, count);
+    chunk->lines = ALLOCATE(int, count);
+    memcpy(chunk->lines, lines, sizeof(int) * count);
+    chunk->count = count;
+    chunk->capacity = count;
+
+    chunk->caches = ALLOCATE(InlineCache, cacheCount);
+    chunk->cacheCapacity = cacheCount;
+    while (chunk->cacheCount < cacheCount) addInlineCache(chunk);
+    return true;
+}
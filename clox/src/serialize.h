@@ -0,0 +1,86 @@
+#ifndef CLOX_SERIALIZE_H
+#define CLOX_SERIALIZE_H
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+// Shared by the files the VM writes for later runs : bytecode caches and
+// heap images. Both start with a four character magic, a format version,
+// the number of instructions the VM knows and a checksum of the rest of the
+// file, and are only read back when all four match. Everything else is in
+// native byte order.
+typedef struct {
+    uint8_t *data;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+// Reads never run past the end of the file : once one would, it fails and
+// every later read returns zeroes.
+typedef struct {
+    const uint8_t *start;
+    const uint8_t *current;
+    const uint8_t *end;
+    bool failed;
+} Reader;
+
+// FNV-1a, taking in eight bytes at a time
+uint64_t
+hashBytes(const void *bytes, size_t length);
+
+void
+beginFile(Buffer *buffer, const char *magic, int version);
+
+// Fills in the checksum and frees the buffer. The file is written aside
+// and renamed into place, so no reader ever sees half of it.
+bool
+writeFile(Buffer *buffer, const char *path);
+
+void
+writeBytes(Buffer *buffer, const void *bytes, size_t count);
+
+void
+writeInt(Buffer *buffer, int32_t value);
+
+void
+writeLong(Buffer *buffer, uint64_t value);
+
+void
+writeString(Buffer *buffer, ObjString *string);
+
+// A chunk's code, line table and number of inline caches. The caches start
+// out empty again when they are read.
+void
+writeCode(Buffer *buffer, Chunk *chunk);
+
+// Maps the file and checks its header, leaving the reader just past it
+bool
+mapFile(Reader *reader, const char *path, const char *magic, int version);
+
+void
+unmapFile(Reader *reader);
+
+const uint8_t *
+readBytes(Reader *reader, size_t count);
+
+int32_t
+readInt(Reader *reader);
+
+uint64_t
+readLong(Reader *reader);
+
+// Takes a string written by writeString() and interns it
+ObjString *
+readString(Reader *reader);
+
+// Counts are checked against what is left of the file, given the smallest
+// size an element takes in it, before anything is allocated for them
+int32_t
+readCount(Reader *reader, size_t elementSize);
+
+// Skips the code when the chunk is NULL
+bool
+readCode(Reader *reader, Chunk *chunk);
+
+#endif // CLOX_SERIALIZE_H
@@ -164,7 +164,9 @@ tableRemoveWhite(Table *table)
     for (int i = 0; i < table->capacity; i++) {
         Entry *entry = &table->entries[i];
 
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
+        // Young strings are left to nursery collections
+        if (entry->key != NULL && !isYoung((Obj *)entry->key) &&
+            !testMark((Obj *)entry->key)) {
             tableDelete(table, entry->key);
         }
     }
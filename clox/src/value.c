@@ -24,6 +24,7 @@ valuesEqual(Value a, Value b)
         case VAL_NIL:       return true;
         case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_UNDEFINED: return true;
         default:            return false; // Unreachable
     }
 
@@ -80,6 +81,7 @@ printValue(Value value)
         case VAL_NIL:       printf("nil");                              break;
         case VAL_NUMBER:    printf("%g", AS_NUMBER(value));             break;
         case VAL_OBJ:       printObject(value);                         break;
+        case VAL_UNDEFINED: printf("undefined");                        break;
     }
 
 #endif // NAN_BOXING
@@ -6,6 +6,9 @@
 #include "common.h"
 
 typedef struct Obj Obj;
+typedef struct ObjClass ObjClass;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjShape ObjShape;
 typedef struct ObjString ObjString;
 
 #ifdef NAN_BOXING
@@ -13,15 +16,17 @@ typedef struct ObjString ObjString;
 #define SIGN_BIT            ((uint64_t)0x8000000000000000)
 #define QNAN                ((uint64_t)0x7ffc000000000000)
 
-#define TAG_NIL     1 // 01
-#define TAG_FALSE   2 // 10
-#define TAG_TRUE    3 // 11
+#define TAG_NIL         1 // 001
+#define TAG_FALSE       2 // 010
+#define TAG_TRUE        3 // 011
+#define TAG_UNDEFINED   4 // 100
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
@@ -34,6 +39,7 @@ typedef uint64_t Value;
 #define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define NUMBER_VAL(num)     numToValue(num)
 #define OBJ_VAL(obj)        (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 
 static inline double
 valueToNum(Value value)
@@ -57,7 +63,8 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_UNDEFINED
 } ValueType;
 
 typedef struct {
@@ -73,6 +80,7 @@ typedef struct {
 #define IS_NIL(value)           ((value).type == VAL_NIL)
 #define IS_NUMBER(value)        ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)           ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value)     ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)          ((value).as.boolean)
 #define AS_NUMBER(value)        ((value).as.number)
@@ -82,6 +90,7 @@ typedef struct {
 #define NIL_VAL                 ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)       ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)         ((Value){VAL_OBJ, {.obj = (Obj *)object}})
+#define UNDEFINED_VAL           ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif // NAN_BOXING
 
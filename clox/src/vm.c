@@ -1,15 +1,19 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "bytecode.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "isolate.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
-VM vm;
+_Thread_local VM *currentVM = NULL;
 
 static Value
 clockNative(int argCount, Value *args)
@@ -17,6 +21,76 @@ clockNative(int argCount, Value *args)
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// The instance being filled in is on top of the stack
+static void
+setStat(const char *name, double value)
+{
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    instanceSetField(AS_INSTANCE(vm.stackTop[-2]), AS_STRING(vm.stackTop[-1]),
+                     NUMBER_VAL(value));
+    pop();
+}
+
+// gcStats() returns the collectors' counters as the fields of an instance.
+// gcStats(type) returns the allocation counters of one type of object, by
+// the name --stats lists it under, or nil for an unknown name.
+static Value
+gcStatsNative(int argCount, Value *args)
+{
+    int type = -1;
+    if (argCount > 0) {
+        if (!IS_STRING(args[0])) return NIL_VAL;
+
+        for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+            if (strcmp(AS_CSTRING(args[0]), objTypeName((ObjType)i)) == 0) {
+                type = i;
+            }
+        }
+
+        if (type == -1) return NIL_VAL;
+    }
+
+    GcStats *stats = &vm.stats;
+    push(OBJ_VAL(copyString("GcStats", 7)));
+    push(OBJ_VAL(newClass(AS_STRING(vm.stackTop[-1]))));
+    push(OBJ_VAL(newInstance(AS_CLASS(vm.stackTop[-1]))));
+
+    if (type != -1) {
+        setStat("objectsAllocated", stats->objectsAllocated[type]);
+        setStat("objectsFreed", stats->objectsFreed[type]);
+        setStat("bytesAllocated", stats->bytesAllocated[type]);
+        setStat("bytesFreed", stats->bytesFreed[type]);
+    } else {
+        uint64_t objectsAllocated = 0, objectsFreed = 0;
+        uint64_t bytesAllocated = 0, bytesFreed = 0;
+        for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+            objectsAllocated += stats->objectsAllocated[i];
+            objectsFreed += stats->objectsFreed[i];
+            bytesAllocated += stats->bytesAllocated[i];
+            bytesFreed += stats->bytesFreed[i];
+        }
+
+        setStat("collections", stats->cycles);
+        setStat("nurseryCollections", stats->nurseryCollections);
+        setStat("compactions", stats->compactions);
+        setStat("pauses", stats->pauses);
+        setStat("pauseTotal", stats->pauseTotal / 1e6);
+        setStat("pauseMax", stats->pauseMax / 1e6);
+        setStat("markTotal", stats->markTotal / 1e6);
+        setStat("heapSize", vm.bytesAllocated);
+        setStat("heapAfterGC", stats->heapAfterGC);
+        setStat("objectsAllocated", objectsAllocated);
+        setStat("objectsFreed", objectsFreed);
+        setStat("bytesAllocated", bytesAllocated);
+        setStat("bytesFreed", bytesFreed);
+        setStat("strings", countInternedStrings());
+    }
+
+    Value instance = pop();
+    vm.stackTop -= 2;
+    return instance;
+}
+
 static void
 resetStack()
 {
@@ -25,7 +99,7 @@ resetStack()
     vm.openUpvalues = NULL;
 }
 
-static void
+void
 runtimeError(const char *fmt, ...)
 {
     va_list args;
@@ -51,44 +125,144 @@ runtimeError(const char *fmt, ...)
     resetStack();
 }
 
+typedef struct {
+    const char *name;
+    NativeFn function;
+} NativeDef;
+
+static const NativeDef natives[] = {
+    { "clock",      clockNative },
+    { "gcStats",    gcStatsNative },
+    { "spawn",      spawnNative },
+    { "join",       joinNative },
+    { "channel",    channelNative },
+    { "send",       sendNative },
+    { "receive",    receiveNative },
+};
+
+#define NATIVE_COUNT ((int)(sizeof(natives) / sizeof(natives[0])))
+
+int
+nativeIndex(NativeFn function)
+{
+    for (int i = 0; i < NATIVE_COUNT; i++) {
+        if (natives[i].function == function) return i;
+    }
+
+    return -1;
+}
+
+NativeFn
+nativeAt(int index)
+{
+    return index >= 0 && index < NATIVE_COUNT ? natives[index].function : NULL;
+}
+
 static void
 defineNative(const char *name, NativeFn function)
 {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = resolveGlobal(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
+int
+resolveGlobal(ObjString *name)
+{
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    push(OBJ_VAL(name));
+    int index = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL((double)index));
+    pop();
+
+    return index;
+}
+
 void
-initVM()
+initVM(VM *machine)
 {
+    currentVM = machine;
+
+    vm.frames = NULL;
+    vm.frameCapacity = 0;
+    vm.stack = (Value *)malloc(sizeof(Value) * FRAME_STACK);
+    if (vm.stack == NULL) exit(1);
+    vm.stackCapacity = FRAME_STACK;
+
     resetStack();
-    vm.objects = NULL;
+    initHeap(&vm.heap);
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.nextGC = GC_START;
+    vm.gcPhase = GC_IDLE;
+    vm.gcPause = GC_PAUSE;
+    vm.gcLimit = 0;
+    vm.gcGrowth = GC_GROWTH;
+    vm.gcSoftLimit = 0;
+    memset(&vm.stats, 0, sizeof(GcStats));
+    vm.gcCompact = false;
+    vm.gcPaused = false;
+    vm.compactDue = false;
+    vm.gcThreads = 1;
+    vm.markers = NULL;
+
+    vm.nursery = (uint8_t *)malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL) exit(1);
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryFull = false;
+    vm.pretenure = true;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
-    initTable(&vm.globals);
+#ifdef JIT
+    vm.jitEnabled = true;
+#endif // JIT
+
+#ifdef COUNT_INSTRUCTIONS
+    vm.instructionCount = 0;
+#endif // COUNT_INSTRUCTIONS
+
     initTable(&vm.strings);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalNames);
+    initValueArray(&vm.globalValues);
 
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
 
-    defineNative("clock", clockNative);
+    for (int i = 0; i < NATIVE_COUNT; i++) {
+        defineNative(natives[i].name, natives[i].function);
+    }
+    vm.pretenure = false;
 }
 
 void
 freeVM()
 {
-    freeTable(&vm.globals);
     freeTable(&vm.strings);
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalNames);
+    freeValueArray(&vm.globalValues);
     vm.initString = NULL;
     freeObjects();
+
+    free(vm.frames);
+    free(vm.stack);
+    free(vm.nursery);
+    currentVM = NULL;
 }
 
 void
@@ -123,18 +297,84 @@ concatenate()
     ObjString *b = AS_STRING(peek(0));
     ObjString *a = AS_STRING(peek(1));
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    ObjString *result = newString(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
 
-    ObjString *result = takeString(chars, length);
+    result = internString(result);
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
+// Slow path of the fused additions, with both operands on the stack
+bool
+addValues()
+{
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        concatenate();
+    } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+    } else {
+        runtimeError("Operands must be numbers or strings.");
+        return false;
+    }
+
+    return true;
+}
+
+#ifdef JIT
+// Compiles a function once it has run often enough. A function that fails
+// to compile stays interpreted for good.
+static inline void
+countHotness(ObjFunction *function)
+{
+    if (function->hotness > 0 && --function->hotness == 0 && vm.jitEnabled) {
+        if (!jitCompile(function)) function->hotness = -1;
+    }
+}
+#endif // JIT
+
+static void
+growFrames()
+{
+    int capacity = GROW_CAPACITY(vm.frameCapacity);
+    if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+
+    vm.frames = (CallFrame *)realloc(vm.frames, sizeof(CallFrame) * capacity);
+    if (vm.frames == NULL) exit(1);
+    vm.frameCapacity = capacity;
+}
+
+// Doubles the value stack. Everything pointing into it moves along : the
+// stack top, the slots of every frame and the open upvalues. Native
+// functions never see this, as the stack only grows when a frame is pushed.
+static void
+growStack()
+{
+    int capacity = vm.stackCapacity * 2;
+    Value *stack = (Value *)malloc(sizeof(Value) * capacity);
+    if (stack == NULL) exit(1);
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+}
+
 static bool
 call(ObjClosure *closure, int argCount)
 {
@@ -149,6 +389,15 @@ call(ObjClosure *closure, int argCount)
         return false;
     }
 
+    if (vm.frameCount == vm.frameCapacity) growFrames();
+
+    int needed = closure->function->maxSlots + FRAME_STACK;
+    while (vm.stackTop - vm.stack > vm.stackCapacity - needed) growStack();
+
+#ifdef JIT
+    countHotness(closure->function);
+#endif // JIT
+
     CallFrame *frame = &vm.frames[vm.frameCount++];
 
     frame->closure = closure;
@@ -158,7 +407,7 @@ call(ObjClosure *closure, int argCount)
     return true;
 }
 
-static bool
+bool
 callValue(Value callee, int argCount)
 {
     if (IS_OBJ(callee)) {
@@ -204,7 +453,24 @@ callValue(Value callee, int argCount)
     return false;
 }
 
-static bool
+// Calls the value below the arguments in place of the current frame. The
+// callee and its arguments move down over the frame's slots, so the result
+// lands where the current function's own return value would have.
+bool
+tailCall(int argCount)
+{
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    Value *callee = vm.stackTop - argCount - 1;
+
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    vm.frameCount--;
+
+    return callValue(frame->slots[0], argCount);
+}
+
+bool
 invokeFromClass(ObjClass *klass, ObjString *name, int argCount)
 {
     Value method;
@@ -216,8 +482,154 @@ invokeFromClass(ObjClass *klass, ObjString *name, int argCount)
     return call(AS_CLOSURE(method), argCount);
 }
 
+static CacheEntry *
+findCacheEntry(InlineCache *cache, ObjShape *shape)
+{
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) return &cache->entries[i];
+    }
+
+    return NULL;
+}
+
+static CacheEntry *
+updateCache(InlineCache *cache, ObjShape *shape, CacheKind kind, int slot)
+{
+    if (cache->megamorphic) return NULL;
+
+    CacheEntry *entry = findCacheEntry(cache, shape);
+    if (entry == NULL) {
+        if (cache->count == CACHE_WAYS) {
+            // Too many receiver shapes, stop caching at this site
+            cache->megamorphic = true;
+            cache->count = 0;
+            return NULL;
+        }
+
+        entry = &cache->entries[cache->count++];
+    }
+
+    // The shape leads to its class and transitions, so it keeps whatever
+    // else the entry points to alive
+    entry->shape = shape;
+    entry->kind = kind;
+    entry->slot = slot;
+    shadeObject((Obj *)shape);
+    return entry;
+}
+
 static bool
-invoke(ObjString *name, int argCount)
+findProperty(ObjInstance *instance, ObjString *name, InlineCache *cache,
+             Value *value, bool *isMethod)
+{
+    ObjShape *shape = instance->shape;
+
+    // A shape fixes both the field layout and the class, so it is enough
+    // to know a cached slot or method still applies.
+    CacheEntry *entry = findCacheEntry(cache, shape);
+    if (entry != NULL) {
+        if (entry->kind == CACHE_FIELD) {
+            *value = *instanceSlot(instance, entry->slot);
+            *isMethod = false;
+            return true;
+        }
+
+        if (entry->kind == CACHE_METHOD) {
+            *value = OBJ_VAL(entry->as.method);
+            *isMethod = true;
+            return true;
+        }
+    }
+
+    // Cache miss : fields shadow methods, so they are searched first
+    if (shape == NULL) {
+        if (tableGet(instance->as.dictionary, name, value)) {
+            *isMethod = false;
+            return true;
+        }
+    } else {
+        int slot = shapeFindSlot(shape, name);
+        if (slot != -1) {
+            updateCache(cache, shape, CACHE_FIELD, slot);
+            *value = *instanceSlot(instance, slot);
+            *isMethod = false;
+            return true;
+        }
+    }
+
+    if (!tableGet(&instance->klass->methods, name, value)) return false;
+
+    if (shape != NULL) {
+        entry = updateCache(cache, shape, CACHE_METHOD, -1);
+        if (entry != NULL) entry->as.method = AS_CLOSURE(*value);
+    }
+
+    *isMethod = true;
+    return true;
+}
+
+void
+setProperty(ObjInstance *instance, ObjString *name, Value value,
+            InlineCache *cache)
+{
+    ObjShape *shape = instance->shape;
+
+    CacheEntry *entry = findCacheEntry(cache, shape);
+    if (entry != NULL) {
+        if (entry->kind == CACHE_FIELD) {
+            *instanceSlot(instance, entry->slot) = value;
+            writeBarrier((Obj *)instance, value);
+            return;
+        }
+
+        if (entry->kind == CACHE_TRANSITION) {
+            instanceAddField(instance, entry->as.transition, value);
+            return;
+        }
+    }
+
+    instanceSetField(instance, name, value);
+
+    // Dictionary mode instances never hit a cache
+    if (shape == NULL || instance->shape == NULL) return;
+
+    if (instance->shape == shape) {
+        updateCache(cache, shape, CACHE_FIELD, shapeFindSlot(shape, name));
+    } else {
+        entry = updateCache(cache, shape, CACHE_TRANSITION,
+                            instance->shape->slot);
+        if (entry != NULL) entry->as.transition = instance->shape;
+    }
+}
+
+// Replaces the instance on top of the stack with its property
+bool
+getProperty(ObjString *name, InlineCache *cache)
+{
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instance of a class have properties.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+
+    Value value;
+    bool isMethod;
+    if (!findProperty(instance, name, cache, &value, &isMethod)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    if (isMethod) {
+        value = OBJ_VAL(newBoundMethod(peek(0), AS_CLOSURE(value)));
+    }
+
+    vm.stackTop[-1] = value;
+    return true;
+}
+
+bool
+invoke(ObjString *name, int argCount, InlineCache *cache)
 {
     Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver)) {
@@ -228,15 +640,19 @@ invoke(ObjString *name, int argCount)
     ObjInstance *instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    bool isMethod;
+    if (!findProperty(instance, name, cache, &value, &isMethod)) {
+        runtimeError("Undefined Property '%s'.", name->chars);
+        return false;
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    if (isMethod) return call(AS_CLOSURE(value), argCount);
+
+    vm.stackTop[-argCount - 1] = value;
+    return callValue(value, argCount);
 }
 
-static bool
+bool
 bindMethod(ObjClass *klass, ObjString *name)
 {
     Value method;
@@ -252,7 +668,7 @@ bindMethod(ObjClass *klass, ObjString *name)
     return true;
 }
 
-static ObjUpvalue *
+ObjUpvalue *
 captureUpvalue(Value *local)
 {
     ObjUpvalue *prevUpvalue = NULL;
@@ -279,26 +695,51 @@ captureUpvalue(Value *local)
     return createdUpvalue;
 }
 
-static void
+void
 closeUpvalues(Value *last)
 {
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
         ObjUpvalue *upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj *)upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
 
-static void
+void
+setUpvalue(ObjUpvalue *upvalue, Value value)
+{
+    *upvalue->location = value;
+    writeBarrier((Obj *)upvalue, value);
+}
+
+// Methods live as long as their class, so they are tenured right away. That
+// also keeps inline caches, which nursery collections do not scan, clear of
+// young objects.
+void
 defineMethod(ObjString *name)
 {
+    vm.stackTop[-1] = OBJ_VAL(tenureObject(AS_OBJ(peek(0))));
+
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    objectBarrier((Obj *)klass, (Obj *)name);
+    writeBarrier((Obj *)klass, method);
     pop();
 }
 
+// Copies the methods in bulk, so a marked subclass has them all marked
+void
+inheritMethods(ObjClass *superclass, ObjClass *subclass)
+{
+    tableAddAll(&superclass->methods, &subclass->methods);
+    if (vm.gcPhase == GC_MARK && isMarked((Obj *)subclass)) {
+        markTable(&subclass->methods);
+    }
+}
+
 static InterpretResult
 run()
 {
@@ -309,297 +750,703 @@ run()
 #define READ_STRING()   AS_STRING(READ_CONSTANT())
 #define READ_SHORT()                                                    \
     (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define BINARY_OP(valueType, op)                                        \
+#define READ_CACHE()                                                    \
+    (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_LONG()                                                     \
+    (frame->ip += 4,                                                    \
+     (uint32_t)frame->ip[-4] << 24 | (uint32_t)frame->ip[-3] << 16 |    \
+     (uint32_t)frame->ip[-2] << 8 | (uint32_t)frame->ip[-1])
+#define READ_WIDE_CONSTANT()                                            \
+    (frame->closure->function->chunk.constants.values[READ_SHORT()])
+#define READ_WIDE_STRING()  AS_STRING(READ_WIDE_CONSTANT())
+#define GLOBAL_NAME(slot)   AS_CSTRING(vm.globalNames.values[slot])
+
+// Rewrites the opcode of the instruction being executed. DEOPTIMIZE also
+// backs up and runs the instruction again in its generic form.
+#define QUICKEN(opcode)     (frame->ip[-1] = (opcode))
+#define DEOPTIMIZE(opcode)                                              \
+    do {                                                                \
+        frame->ip[-1] = (opcode);                                       \
+        frame->ip--;                                                    \
+        DISPATCH();                                                     \
+    } while (false)
+
+#define BINARY_OP(valueType, op, quickOp)                               \
     do {                                                                \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {               \
             runtimeError("Operands must be numbers.");                  \
             return INTERPRET_RUNTIME_ERROR;                             \
         }                                                               \
+        QUICKEN(quickOp);                                               \
         double b = AS_NUMBER(*(--vm.stackTop));                         \
         double a = AS_NUMBER(*(--vm.stackTop));                         \
         push(valueType(a op b));                                        \
     } while (false)
+#define BINARY_OP_NUM(valueType, op, genericOp)                         \
+    do {                                                                \
+        Value b = peek(0);                                              \
+        Value a = peek(1);                                              \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) DEOPTIMIZE(genericOp);      \
+        vm.stackTop--;                                                  \
+        vm.stackTop[-1] = valueType(AS_NUMBER(a) op AS_NUMBER(b));      \
+    } while (false)
 
-    for (;;) {
+#define BINARY_OP_NOT(op)                                               \
+    do {                                                                \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {               \
+            runtimeError("Operands must be numbers.");                  \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        double b = AS_NUMBER(*(--vm.stackTop));                         \
+        double a = AS_NUMBER(*(--vm.stackTop));                         \
+        push(BOOL_VAL(!(a op b)));                                      \
+    } while (false)
 
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("        ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
+// Picks up the frame on top of the call stack after a call or a return,
+// and leaves the interpreter when that frame has machine code. Both are
+// safepoints.
+#ifdef JIT
+#define ENTER_FRAME()                                                   \
+    do {                                                                \
+        safepoint();                                                    \
+        frame = &vm.frames[vm.frameCount - 1];                          \
+        if (frame->closure->function->jit != NULL) goto enterCompiled;  \
+    } while (false)
+#else
+#define ENTER_FRAME()                                                   \
+    do {                                                                \
+        safepoint();                                                    \
+        frame = &vm.frames[vm.frameCount - 1];                          \
+    } while (false)
+#endif // JIT
 
-        disassembleInstruction(
-            &frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code)
-        );
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                             \
+    do {                                                                \
+        printf("        ");                                             \
+        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {      \
+            printf("[ ");                                               \
+            printValue(*slot);                                          \
+            printf(" ]");                                               \
+        }                                                               \
+        printf("\n");                                                   \
+                                                                        \
+        disassembleInstruction(                                         \
+            &frame->closure->function->chunk,                           \
+            (int)(frame->ip - frame->closure->function->chunk.code)     \
+        );                                                              \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif // DEBUG_TRACE_EXECUTION
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-            } break;
+#ifdef COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm.instructionCount++)
+#else
+#define COUNT_INSTRUCTION() do { } while (false)
+#endif // COUNT_INSTRUCTIONS
+
+#ifdef COMPUTED_GOTO
+
+    // One label per opcode, indexed by the opcode itself. Every handler
+    // ends by jumping straight to the next handler, which gives each
+    // opcode its own indirect branch for the predictor to learn.
+    static void *dispatchTable[] = {
+        [OP_CONSTANT]       = &&op_CONSTANT,
+        [OP_NIL]            = &&op_NIL,
+        [OP_TRUE]           = &&op_TRUE,
+        [OP_FALSE]          = &&op_FALSE,
+        [OP_EQUAL]          = &&op_EQUAL,
+        [OP_GREATER]        = &&op_GREATER,
+        [OP_LESS]           = &&op_LESS,
+        [OP_ADD]            = &&op_ADD,
+        [OP_SUBTRACT]       = &&op_SUBTRACT,
+        [OP_MULTIPLY]       = &&op_MULTIPLY,
+        [OP_DIVIDE]         = &&op_DIVIDE,
+        [OP_NOT]            = &&op_NOT,
+        [OP_NEGATE]         = &&op_NEGATE,
+        [OP_PRINT]          = &&op_PRINT,
+        [OP_POP]            = &&op_POP,
+        [OP_DEFINE_GLOBAL]  = &&op_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL]     = &&op_GET_GLOBAL,
+        [OP_SET_GLOBAL]     = &&op_SET_GLOBAL,
+        [OP_GET_LOCAL]      = &&op_GET_LOCAL,
+        [OP_SET_LOCAL]      = &&op_SET_LOCAL,
+        [OP_GET_UPVALUE]    = &&op_GET_UPVALUE,
+        [OP_SET_UPVALUE]    = &&op_SET_UPVALUE,
+        [OP_GET_PROPERTY]   = &&op_GET_PROPERTY,
+        [OP_SET_PROPERTY]   = &&op_SET_PROPERTY,
+        [OP_GET_SUPER]      = &&op_GET_SUPER,
+        [OP_JUMP]           = &&op_JUMP,
+        [OP_JUMP_IF_FALSE]  = &&op_JUMP_IF_FALSE,
+        [OP_LOOP]           = &&op_LOOP,
+        [OP_CALL]           = &&op_CALL,
+        [OP_TAIL_CALL]      = &&op_TAIL_CALL,
+        [OP_INVOKE]         = &&op_INVOKE,
+        [OP_SUPER_INVOKE]   = &&op_SUPER_INVOKE,
+        [OP_CLOSURE]        = &&op_CLOSURE,
+        [OP_CLOSE_UPVALUE]  = &&op_CLOSE_UPVALUE,
+        [OP_RETURN]         = &&op_RETURN,
+        [OP_CLASS]          = &&op_CLASS,
+        [OP_INHERIT]        = &&op_INHERIT,
+        [OP_METHOD]         = &&op_METHOD,
+        [OP_WIDE]           = &&op_WIDE,
+
+        [OP_EQUAL_NUM_NUM]      = &&op_EQUAL_NUM_NUM,
+        [OP_GREATER_NUM_NUM]    = &&op_GREATER_NUM_NUM,
+        [OP_LESS_NUM_NUM]       = &&op_LESS_NUM_NUM,
+        [OP_ADD_NUM_NUM]        = &&op_ADD_NUM_NUM,
+        [OP_ADD_STR_STR]        = &&op_ADD_STR_STR,
+        [OP_SUBTRACT_NUM_NUM]   = &&op_SUBTRACT_NUM_NUM,
+        [OP_MULTIPLY_NUM_NUM]   = &&op_MULTIPLY_NUM_NUM,
+        [OP_DIVIDE_NUM_NUM]     = &&op_DIVIDE_NUM_NUM,
+
+        [OP_NOT_EQUAL]              = &&op_NOT_EQUAL,
+        [OP_NOT_GREATER]            = &&op_NOT_GREATER,
+        [OP_NOT_LESS]               = &&op_NOT_LESS,
+        [OP_SET_LOCAL_POP]          = &&op_SET_LOCAL_POP,
+        [OP_ADD_LOCAL_LOCAL]        = &&op_ADD_LOCAL_LOCAL,
+        [OP_ADD_LOCAL_CONST]        = &&op_ADD_LOCAL_CONST,
+        [OP_SUBTRACT_LOCAL_CONST]   = &&op_SUBTRACT_LOCAL_CONST,
+        [OP_GET_LOCAL_PROPERTY]     = &&op_GET_LOCAL_PROPERTY,
+        [OP_LESS_LOCAL_CONST_JUMP]  = &&op_LESS_LOCAL_CONST_JUMP,
+    };
+
+#define DISPATCH_LOOP   DISPATCH();
+#define CASE(name)      op_##name
+#define DISPATCH()                                                      \
+    do {                                                                \
+        TRACE_INSTRUCTION();                                            \
+        COUNT_INSTRUCTION();                                            \
+        goto *dispatchTable[READ_BYTE()];                               \
+    } while (false)
 
-            case OP_NIL:        push(NIL_VAL);              break;
-            case OP_FALSE:      push(BOOL_VAL(true));       break;
+#else
+
+#define DISPATCH_LOOP                                                   \
+    loop:                                                               \
+        TRACE_INSTRUCTION();                                            \
+        COUNT_INSTRUCTION();                                            \
+        switch (READ_BYTE())
+#define CASE(name)      case OP_##name
+#define DISPATCH()      goto loop
+
+#endif // COMPUTED_GOTO
+
+    DISPATCH_LOOP
+    {
+        CASE(CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+        } DISPATCH();
+
+        CASE(NIL):      push(NIL_VAL);              DISPATCH();
+        CASE(FALSE):    push(BOOL_VAL(false));      DISPATCH();
+
+        CASE(EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(OP_EQUAL_NUM_NUM);
+            push(BOOL_VAL(valuesEqual(a, b)));
+        } DISPATCH();
+
+        CASE(GREATER):  BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM_NUM);    DISPATCH();
+        CASE(LESS):     BINARY_OP(BOOL_VAL, <, OP_LESS_NUM_NUM);       DISPATCH();
+        CASE(TRUE):     push(BOOL_VAL(true));                           DISPATCH();
+
+        CASE(ADD): {
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                QUICKEN(OP_ADD_STR_STR);
+                concatenate();
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_ADD_NUM_NUM);
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+            } else {
+                runtimeError("Operands must be numbers or strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+        } DISPATCH();
 
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-            } break;
+        CASE(SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM_NUM); DISPATCH();
+        CASE(MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM_NUM); DISPATCH();
+        CASE(DIVIDE):   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM_NUM);   DISPATCH();
 
-            case OP_GREATER:    BINARY_OP(BOOL_VAL, >);     break;
-            case OP_LESS:       BINARY_OP(BOOL_VAL, <);     break;
-            case OP_TRUE:       push(BOOL_VAL(false));      break;
-
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be numbers or strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-            } break;
+        CASE(NOT): {
+            push(BOOL_VAL(isFalsey(pop())));
+        } DISPATCH();
 
-            case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -);   break;
-            case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *);   break;
-            case OP_DIVIDE:     BINARY_OP(NUMBER_VAL, /);   break;
+        CASE(NEGATE): {
+            if (!IS_NUMBER(peek(0))) {
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-            case OP_NOT: {
-                push(BOOL_VAL(isFalsey(pop())));
-            } break;
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+        } DISPATCH();
 
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(PRINT): {
+            printValue(pop());
+            printf("\n");
+        } DISPATCH();
 
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-            } break;
+        CASE(POP):      pop();                      DISPATCH();
 
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-            } break;
+        CASE(DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = peek(0);
+            pop();
+        } DISPATCH();
 
-            case OP_POP:    pop();                          break;
+        CASE(GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
 
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-            } break;
+            if (IS_UNDEFINED(value)) {
+                runtimeError("Undefined Variable '%s'.", GLOBAL_NAME(slot));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(value);
+        } DISPATCH();
 
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
+        CASE(SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
 
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined Variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-            } break;
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                runtimeError("Undefined Variable '%s'.", GLOBAL_NAME(slot));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.globalValues.values[slot] = peek(0);
+        } DISPATCH();
+
+        CASE(GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(frame->slots[slot]);
+        } DISPATCH();
+
+        CASE(SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(0);
+        } DISPATCH();
+
+        CASE(GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(*frame->closure->upvalues[slot]->location);
+        } DISPATCH();
+
+        CASE(SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            setUpvalue(frame->closure->upvalues[slot], peek(0));
+        } DISPATCH();
+
+        CASE(GET_PROPERTY): {
+            ObjString *name = READ_STRING();
+            if (!getProperty(name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+        } DISPATCH();
 
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
+        CASE(SET_PROPERTY): {
+            if (!IS_INSTANCE(peek(1))) {
+                runtimeError("Only instances of a class have fields.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined Variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-            } break;
+            ObjInstance *instance = AS_INSTANCE(peek(1));
+            ObjString *name = READ_STRING();
+            setProperty(instance, name, peek(0), READ_CACHE());
 
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-            } break;
+            Value value = pop();
+            pop();
+            push(value);
+        } DISPATCH();
 
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-            } break;
+        CASE(GET_SUPER): {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(pop());
 
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-            } break;
+            if (!bindMethod(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+        } DISPATCH();
+
+        CASE(JUMP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+        } DISPATCH();
+
+        CASE(JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0))) frame->ip += offset;
+        } DISPATCH();
+
+        CASE(LOOP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip -= offset;
+            safepoint();
+
+#ifdef JIT
+            ObjFunction *function = frame->closure->function;
+            countHotness(function);
+            if (function->jit != NULL) goto enterCompiled;
+#endif // JIT
+        } DISPATCH();
+
+        CASE(CALL): {
+            int argCount = READ_BYTE();
+
+            if (!callValue(peek(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+        } DISPATCH();
 
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-            } break;
+        CASE(TAIL_CALL): {
+            int argCount = READ_BYTE();
 
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instance of a class have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            if (!tailCall(argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
+            // A native or a class without an initializer pushes no frame,
+            // so a tail call from the bottom one leaves nothing to run
+            if (vm.frameCount == 0) return INTERPRET_OK;
+            ENTER_FRAME();
+        } DISPATCH();
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance
-                    push(value);
-                    break;
-                }
+        CASE(INVOKE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
 
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-            } break;
+            if (!invoke(method, argCount, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+        } DISPATCH();
 
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances of a class have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(SUPER_INVOKE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass *superclass = AS_CLASS(pop());
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+            if (!invokeFromClass(superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+        } DISPATCH();
 
-                Value value = pop();
-                pop();
-                push(value);
-            } break;
+        CASE(CLOSURE): {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure *closure = newClosure(function);
+            push(OBJ_VAL(closure));
 
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
 
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (isLocal) {
+                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-            } break;
+                objectBarrier((Obj *)closure, (Obj *)closure->upvalues[i]);
+            }
+        } DISPATCH();
+
+        CASE(CLOSE_UPVALUE): {
+            closeUpvalues(vm.stackTop - 1);
+            pop();
+        } DISPATCH();
+
+        CASE(RETURN): {
+            Value result = pop();
+            closeUpvalues(frame->slots);
+
+            vm.frameCount--;
+            vm.stackTop = frame->slots;
+            push(result);
+            if (vm.frameCount == 0) return INTERPRET_OK;
+
+            ENTER_FRAME();
+        } DISPATCH();
+
+        CASE(CLASS): {
+            push(OBJ_VAL(newClass(READ_STRING())));
+        } DISPATCH();
+
+        CASE(INHERIT): {
+            Value superclass = peek(1);
+            if (!IS_CLASS(superclass)) {
+                runtimeError("Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-            } break;
+            ObjClass *subclass = AS_CLASS(peek(0));
+            inheritMethods(AS_CLASS(superclass), subclass);
+            pop(); // Subclass
+        } DISPATCH();
+
+        CASE(METHOD): {
+            defineMethod(READ_STRING());
+        } DISPATCH();
+
+        // Long forms only show up in very large functions, so they share a
+        // single handler. Such functions are never compiled by the JIT.
+        CASE(WIDE): {
+            switch (READ_BYTE()) {
+                case OP_CONSTANT:
+                    push(READ_WIDE_CONSTANT());
+                    break;
 
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-            } break;
+                case OP_GET_LOCAL:
+                    push(frame->slots[READ_SHORT()]);
+                    break;
 
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-            } break;
+                case OP_SET_LOCAL:
+                    frame->slots[READ_SHORT()] = peek(0);
+                    break;
 
-            case OP_CALL: {
-                int argCount = READ_BYTE();
+                case OP_GET_UPVALUE:
+                    push(*frame->closure->upvalues[READ_SHORT()]->location);
+                    break;
 
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-            } break;
+                case OP_SET_UPVALUE:
+                    setUpvalue(frame->closure->upvalues[READ_SHORT()], peek(0));
+                    break;
 
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
+                case OP_GET_PROPERTY: {
+                    ObjString *name = READ_WIDE_STRING();
+                    if (!getProperty(name, READ_CACHE())) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                } break;
 
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-            } break;
+                case OP_SET_PROPERTY: {
+                    if (!IS_INSTANCE(peek(1))) {
+                        runtimeError("Only instances of a class have fields.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
 
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
+                    ObjInstance *instance = AS_INSTANCE(peek(1));
+                    ObjString *name = READ_WIDE_STRING();
+                    setProperty(instance, name, peek(0), READ_CACHE());
 
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-            } break;
+                    Value value = pop();
+                    pop();
+                    push(value);
+                } break;
 
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
+                case OP_GET_SUPER: {
+                    ObjString *name = READ_WIDE_STRING();
+                    if (!bindMethod(AS_CLASS(pop()), name)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                } break;
+
+                case OP_JUMP: {
+                    uint32_t offset = READ_LONG();
+                    frame->ip += offset;
+                } break;
+
+                case OP_JUMP_IF_FALSE: {
+                    uint32_t offset = READ_LONG();
+                    if (isFalsey(peek(0))) frame->ip += offset;
+                } break;
+
+                case OP_LOOP: {
+                    uint32_t offset = READ_LONG();
+                    frame->ip -= offset;
+                    safepoint();
+                } break;
+
+                case OP_INVOKE: {
+                    ObjString *method = READ_WIDE_STRING();
+                    int argCount = READ_BYTE();
+
+                    if (!invoke(method, argCount, READ_CACHE())) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    ENTER_FRAME();
+                } break;
 
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+                case OP_SUPER_INVOKE: {
+                    ObjString *method = READ_WIDE_STRING();
+                    int argCount = READ_BYTE();
+                    ObjClass *superclass = AS_CLASS(pop());
 
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+                    if (!invokeFromClass(superclass, method, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
                     }
-                }
-            } break;
+                    ENTER_FRAME();
+                } break;
+
+                case OP_CLOSURE: {
+                    ObjFunction *function = AS_FUNCTION(READ_WIDE_CONSTANT());
+                    ObjClosure *closure = newClosure(function);
+                    push(OBJ_VAL(closure));
+
+                    for (int i = 0; i < closure->upvalueCount; i++) {
+                        uint8_t isLocal = READ_BYTE();
+                        uint16_t index = READ_SHORT();
+
+                        if (isLocal) {
+                            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                        } else {
+                            closure->upvalues[i] = frame->closure->upvalues[index];
+                        }
+                        objectBarrier((Obj *)closure, (Obj *)closure->upvalues[i]);
+                    }
+                } break;
 
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-            } break;
+                case OP_CLASS:
+                    push(OBJ_VAL(newClass(READ_WIDE_STRING())));
+                    break;
 
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
+                case OP_METHOD:
+                    defineMethod(READ_WIDE_STRING());
+                    break;
 
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
+                default:
+                    runtimeError("Unknown wide OpCode.");
+                    return INTERPRET_RUNTIME_ERROR;
+            }
+        } DISPATCH();
+
+        CASE(EQUAL_NUM_NUM): {
+            Value b = peek(0);
+            Value a = peek(1);
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) DEOPTIMIZE(OP_EQUAL);
+            vm.stackTop--;
+            vm.stackTop[-1] = BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));
+        } DISPATCH();
+
+        CASE(GREATER_NUM_NUM):  BINARY_OP_NUM(BOOL_VAL, >, OP_GREATER);     DISPATCH();
+        CASE(LESS_NUM_NUM):     BINARY_OP_NUM(BOOL_VAL, <, OP_LESS);        DISPATCH();
+        CASE(ADD_NUM_NUM):      BINARY_OP_NUM(NUMBER_VAL, +, OP_ADD);       DISPATCH();
+
+        CASE(ADD_STR_STR): {
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) DEOPTIMIZE(OP_ADD);
+            concatenate();
+        } DISPATCH();
+
+        CASE(SUBTRACT_NUM_NUM): BINARY_OP_NUM(NUMBER_VAL, -, OP_SUBTRACT);  DISPATCH();
+        CASE(MULTIPLY_NUM_NUM): BINARY_OP_NUM(NUMBER_VAL, *, OP_MULTIPLY);  DISPATCH();
+        CASE(DIVIDE_NUM_NUM):   BINARY_OP_NUM(NUMBER_VAL, /, OP_DIVIDE);    DISPATCH();
+
+        CASE(NOT_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(!valuesEqual(a, b)));
+        } DISPATCH();
+
+        CASE(NOT_GREATER):  BINARY_OP_NOT(>);  DISPATCH();
+        CASE(NOT_LESS):     BINARY_OP_NOT(<);  DISPATCH();
+
+        CASE(SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = pop();
+        } DISPATCH();
+
+        CASE(ADD_LOCAL_LOCAL): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = frame->slots[READ_BYTE()];
+
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else {
+                push(a);
+                push(b);
+                if (!addValues()) return INTERPRET_RUNTIME_ERROR;
+            }
+        } DISPATCH();
+
+        CASE(ADD_LOCAL_CONST): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else {
+                push(a);
+                push(b);
+                if (!addValues()) return INTERPRET_RUNTIME_ERROR;
+            }
+        } DISPATCH();
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-            } break;
+        CASE(SUBTRACT_LOCAL_CONST): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
 
-            case OP_CLASS: {
-                push(OBJ_VAL(newClass(READ_STRING())));
-            } break;
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)));
+        } DISPATCH();
 
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(GET_LOCAL_PROPERTY): {
+            push(frame->slots[READ_BYTE()]);
 
-                ObjClass *subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass
-            } break;
+            ObjString *name = READ_STRING();
+            if (!getProperty(name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+        } DISPATCH();
 
-            case OP_METHOD: {
-                defineMethod(READ_STRING());
-            } break;
-        }
+        CASE(LESS_LOCAL_CONST_JUMP): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!(AS_NUMBER(a) < AS_NUMBER(b))) frame->ip += offset;
+        } DISPATCH();
     }
 
+    // Only reachable through a corrupt opcode in the switch fallback
+    runtimeError("Unknown OpCode.");
+    return INTERPRET_RUNTIME_ERROR;
+
+#ifdef JIT
+enterCompiled: {
+        JitStatus status = jitRun();
+        if (status == JIT_EXIT_DONE) return INTERPRET_OK;
+        if (status == JIT_EXIT_ERROR) return INTERPRET_RUNTIME_ERROR;
+    }
+
+    frame = &vm.frames[vm.frameCount - 1];
+    DISPATCH();
+#endif // JIT
+
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_CACHE
+#undef READ_LONG
+#undef READ_WIDE_CONSTANT
+#undef READ_WIDE_STRING
+#undef GLOBAL_NAME
+#undef QUICKEN
+#undef DEOPTIMIZE
 #undef BINARY_OP
+#undef BINARY_OP_NUM
+#undef BINARY_OP_NOT
+#undef ENTER_FRAME
+#undef TRACE_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef DISPATCH_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult
-interpret(const char *source)
+static InterpretResult
+runScript(ObjFunction *function)
 {
-    ObjFunction *function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
     push(OBJ_VAL(function));
@@ -607,7 +1454,48 @@ interpret(const char *source)
     ObjClosure *closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
-    call(closure, 0);
 
+    InterpretResult result = runCall(0);
+    if (result == INTERPRET_OK) pop();
+    return result;
+}
+
+InterpretResult
+runCall(int argCount)
+{
+    if (!callValue(vm.stackTop[-1 - argCount], argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    // Natives and classes without an initializer are done already
+    if (vm.frameCount == 0) return INTERPRET_OK;
     return run();
 }
+
+InterpretResult
+interpret(const char *source)
+{
+    // Old functions must not point into the nursery, so it starts out empty
+    // and the compiler allocates everything in the old generation
+    collectNursery();
+    vm.pretenure = true;
+    ObjFunction *function = compile(source);
+    vm.pretenure = false;
+
+    return runScript(function);
+}
+
+InterpretResult
+interpretCached(const char *source, const char *cachePath)
+{
+    collectNursery();
+    vm.pretenure = true;
+    ObjFunction *function = loadBytecode(cachePath, source);
+    if (function == NULL) {
+        function = compile(source);
+        if (function != NULL) saveBytecode(cachePath, source, function);
+    }
+    vm.pretenure = false;
+
+    return runScript(function);
+}
@@ -2,12 +2,21 @@
 #define CLOX_VM_H
 
 #include "common.h"
+#include "heap.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Deepest call stack before a "Stack overflow." error. Both stacks start
+// small and grow on demand up to it; build with EXTRA=-DFRAMES_MAX=<n> to
+// change the limit.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 16384
+#endif // FRAMES_MAX
+
+// Stack slots guaranteed to a frame beyond the most its code uses when it
+// is pushed, for natives and the values the runtime pushes on its own.
+#define FRAME_STACK (2 * UINT8_COUNT)
 
 typedef struct {
     ObjClosure *closure;
@@ -15,26 +24,87 @@ typedef struct {
     Value *slots;
 } CallFrame;
 
+// Where the old generation's collector is in its cycle. Marking and
+// sweeping both advance in slices between runs of the program.
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP
+} GcPhase;
+
+// Counters kept by the collectors, for gcStats() and --stats. Pauses are
+// the times the program waits on a collector, in microseconds.
+typedef struct {
+    uint64_t cycles;            // Of the old generation, once swept
+    uint64_t nurseryCollections;
+    uint64_t compactions;
+    uint64_t pauses;
+    uint64_t pauseTotal;
+    uint64_t pauseMax;
+    uint64_t markTotal;         // Part of the pauses spent marking the old generation
+    size_t heapAfterGC;         // Heap size at the end of the last cycle
+    uint64_t objectsAllocated[OBJ_TYPE_COUNT];
+    uint64_t objectsFreed[OBJ_TYPE_COUNT];
+    uint64_t bytesAllocated[OBJ_TYPE_COUNT];
+    uint64_t bytesFreed[OBJ_TYPE_COUNT];
+} GcStats;
+
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     int frameCount;
+    int frameCapacity;
 
-    Value stack[STACK_MAX];
+    Value *stack;
     Value *stackTop;
+    int stackCapacity;
 
     ObjUpvalue *openUpvalues;
 
     size_t bytesAllocated;
-    size_t nextGC;
-
-    Obj *objects;
-    Table globals;
+    size_t nextGC;      // Starts the next cycle, or the next slice of one
+    GcPhase gcPhase;
+    int gcPause;        // Slice budget in microseconds, 0 for no limit
+    int gcThreads;      // Threads that share marking
+    struct MarkerPool *markers;
+    size_t gcLimit;     // Heap size past which a cycle ignores the budget
+    int gcGrowth;       // Percent the heap grows by between cycles
+    size_t gcSoftLimit; // Heap size the pacer tries to stay under, or 0
+    bool gcCompact;     // Compact the heap after cycles that fragment it
+    bool gcPaused;      // Nothing collects the old generation while set
+    bool compactDue;
+    GcStats stats;
+
+    Heap heap;          // The old generation
     Table strings;
+
+    // Young objects are bump allocated in the nursery. Old objects that
+    // may point into it are listed in remembered.
+    uint8_t *nursery;
+    uint8_t *nurseryTop;
+    bool nurseryFull;   // A collection is due at the next safepoint
+    bool pretenure;     // Allocate everything in the old generation
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj **remembered;
+
+    // Global variables live in slots resolved by name at compile time.
+    // A slot holds UNDEFINED_VAL until its declaration has run.
+    Table globalSlots;
+    ValueArray globalNames;
+    ValueArray globalValues;
     ObjString *initString;
 
     int grayCount;
     int grayCapacity;
     Obj **grayStack;
+
+#ifdef JIT
+    bool jitEnabled;
+#endif // JIT
+
+#ifdef COUNT_INSTRUCTIONS
+    uint64_t instructionCount;
+#endif // COUNT_INSTRUCTIONS
 } VM;
 
 typedef enum {
@@ -43,21 +113,96 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+// Each thread runs the VM its currentVM points to, which is the one every
+// use of vm refers to. Threads that never set it up have no VM.
+extern _Thread_local VM *currentVM;
+
+#define vm (*currentVM)
 
+// Makes the VM the current thread's and sets it up. It must stay where it
+// is until freeVM(), as the stack and compiled code refer to it.
 void
-initVM();
+initVM(VM *machine);
 
+// Frees the current thread's VM, which the thread is left without
 void
 freeVM();
 
 InterpretResult
 interpret(const char *source);
 
+// Calls the value below the arguments on top of the stack and runs it to
+// the end, in a VM that is running nothing else. On success the result
+// takes the place of the callee and its arguments.
+InterpretResult
+runCall(int argCount);
+
+// Like interpret(), but loads the compiled script from the cache file when
+// it is up to date, and writes it there after compiling otherwise
+InterpretResult
+interpretCached(const char *source, const char *cachePath);
+
+int
+resolveGlobal(ObjString *name);
+
+// Natives are numbered in the order initVM() defines them, which is how
+// heap images refer to them. nativeIndex() returns -1 for a function that
+// is not one, and nativeAt() NULL for a number out of range.
+int
+nativeIndex(NativeFn function);
+
+NativeFn
+nativeAt(int index);
+
 void
 push(Value value);
 
 Value
 pop();
 
+// Operations shared by the interpreter and compiled code. They work on the
+// top of the VM stack and report their own runtime errors.
+void
+runtimeError(const char *fmt, ...);
+
+bool
+addValues();
+
+bool
+callValue(Value callee, int argCount);
+
+bool
+tailCall(int argCount);
+
+bool
+invokeFromClass(ObjClass *klass, ObjString *name, int argCount);
+
+bool
+getProperty(ObjString *name, InlineCache *cache);
+
+void
+setProperty(ObjInstance *instance, ObjString *name, Value value,
+            InlineCache *cache);
+
+bool
+invoke(ObjString *name, int argCount, InlineCache *cache);
+
+bool
+bindMethod(ObjClass *klass, ObjString *name);
+
+ObjUpvalue *
+captureUpvalue(Value *local);
+
+void
+closeUpvalues(Value *last);
+
+void
+setUpvalue(ObjUpvalue *upvalue, Value value);
+
+void
+defineMethod(ObjString *name);
+
+void
+inheritMethods(ObjClass *superclass, ObjClass *subclass);
+
 #endif // CLOX_VM_H
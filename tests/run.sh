@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+#
+# Runs every script under tests/ that has "// expect: " comments with a
+# release build of clox, and compares what it prints with them, in order.
+# Scripts may also hold:
+#
+#   // args: <flags>     Run once per such line with those flags, instead
+#                        of once with --no-jit
+#   // image: <script>   Run the other script first with --save-image and
+#                        start from that image
+#   // stale: <script>   Leave the other script's .loxc cache where this
+#                        script's goes before the first run
+#
+# Every run happens twice on a fresh copy of the script : the first writes
+# its .loxc cache and the second loads it.
+#
+# Usage: tests/run.sh [script.lox ...]
+
+set -uo pipefail
+
+TESTDIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+CLOXDIR="$TESTDIR/../clox"
+WORKDIR="$(mktemp -d)"
+trap 'rm -rf "$WORKDIR"' EXIT
+
+make -s -C "$CLOXDIR" release >/dev/null || exit 1
+CLOX="$CLOXDIR/clox"
+
+if [ $# -eq 0 ]; then
+    set -- $(find "$TESTDIR" -name '*.lox' | sort)
+fi
+
+passed=0
+failed=0
+
+fail() {
+    echo "FAIL $1 $2"
+    diff "$WORKDIR/expected" "$WORKDIR/actual" | sed 's/^/    /'
+    failed=$((failed + 1))
+}
+
+for script in "$@"; do
+    name="${script#$TESTDIR/}"
+    sed -n 's|.*// expect: ||p' "$script" > "$WORKDIR/expected"
+    [ -s "$WORKDIR/expected" ] || continue
+
+    image=$(sed -n 's|.*// image: ||p' "$script")
+    imageflag=""
+    if [ -n "$image" ]; then
+        "$CLOX" --no-cache --save-image="$WORKDIR/image" \
+            "$(dirname "$script")/$image" >/dev/null
+        imageflag="--image=$WORKDIR/image"
+    fi
+
+    stale=$(sed -n 's|.*// stale: ||p' "$script")
+
+    argsets=$(sed -n 's|.*// args: ||p' "$script")
+    [ -z "$argsets" ] && argsets="--no-jit"
+
+    ok=true
+    while IFS= read -r args; do
+        rm -f "$WORKDIR/test.lox" "$WORKDIR/test.loxc"
+        if [ -n "$stale" ]; then
+            cp "$(dirname "$script")/$stale" "$WORKDIR/test.lox"
+            "$CLOX" $imageflag $args "$WORKDIR/test.lox" >/dev/null 2>&1
+        fi
+        cp "$script" "$WORKDIR/test.lox"
+
+        for run in compiled cached; do
+            (cd "$(dirname "$script")" &&
+                "$CLOX" $imageflag $args "$WORKDIR/test.lox") \
+                > "$WORKDIR/actual" 2>/dev/null
+            if ! cmp -s "$WORKDIR/expected" "$WORKDIR/actual"; then
+                fail "$name" "($run, $args)"
+                ok=false
+                break 2
+            fi
+        done
+    done <<< "$argsets"
+
+    $ok && passed=$((passed + 1))
+done
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]